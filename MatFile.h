@@ -2,14 +2,41 @@
 #define __MATFILE_H__
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
-#include <map>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef MATFILE_USE_ZLIB
+#include <zlib.h>
+#endif
 
 /*
  * MAT file data types:
@@ -27,6 +54,7 @@
 #define miINT64  12
 #define miUINT64 13
 #define miMATRIX 14
+#define miCOMPRESSED 15
 
 /*
  * Sizes of matrix subelements:
@@ -36,6 +64,42 @@
 #define ARRAY_NAME_TAG_SIZE  8
 #define RE_TAG_SIZE          8
 
+/*
+ * Level 4 matrix header size, and the location of its number of
+ * columns:
+ */
+#define LEVEL4_HEADER_SIZE  20
+#define LEVEL4_COLS_OFFSET   8
+
+/*
+ * The smallest maximum part size that can be set: a Level 5 header,
+ * the matrix header of a variable whose name is up to 8 characters,
+ * and one 8-byte sample
+ */
+#define MIN_PART_SIZE      200
+
+/*
+ * Bytes between the start of a miCOMPRESSED element and the matrix
+ * it contains, for compressed variables written by MatFile: the tag,
+ * the zlib header, then the header of the stored block holding the
+ * matrix header
+ */
+#define COMPRESSED_PREFIX_SIZE 15
+
+/*
+ * MAT file array classes (of numeric arrays):
+ */
+#define mxDOUBLE_CLASS  6
+#define mxSINGLE_CLASS  7
+#define mxINT8_CLASS    8
+#define mxUINT8_CLASS   9
+#define mxINT16_CLASS  10
+#define mxUINT16_CLASS 11
+#define mxINT32_CLASS  12
+#define mxUINT32_CLASS 13
+#define mxINT64_CLASS  14
+#define mxUINT64_CLASS 15
+
 /*
  * Mapping from MatLab data type to array type:
  */
@@ -45,6 +109,42 @@ static const int mi2mx[16] =
    0,  6,  0,  0,
   14, 15,  0,  0 };
 
+/*
+ * Mapping from array type to MatLab data type:
+ */
+static const int mx2mi[16] =
+{  0,  0,  0,  0,
+   0,  0,  9,  7,
+   1,  2,  3,  4,
+   5,  6, 12, 13 };
+
+/*
+ * Get the size of one sample of the given MatLab data type, or 0 if
+ * it isn't a numeric type
+ */
+inline size_t mi_type_size(int type)
+{
+    switch (type)
+    {
+    case miINT8:
+    case miUINT8:
+        return 1;
+    case miINT16:
+    case miUINT16:
+        return 2;
+    case miINT32:
+    case miUINT32:
+    case miSINGLE:
+        return 4;
+    case miDOUBLE:
+    case miINT64:
+    case miUINT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
 inline char separator()
 {
 #ifdef _WIN32
@@ -54,6 +154,35 @@ inline char separator()
 #endif
 }
 
+/*
+ * Create a directory, unless it already exists
+ */
+inline bool make_dir(const std::string& dir)
+{
+#ifdef _WIN32
+    return ::_mkdir(dir.c_str()) == 0 || errno == EEXIST;
+#else
+    return ::mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/*
+ * Hash a variable name (64-bit FNV-1a). This is constexpr so that
+ * names known at compile time can be hashed then (see MatFile::Key)
+ */
+inline constexpr std::uint64_t name_hash(std::string_view name)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
 /*
  * The following template specializations are used to determine
  * the type of each variable. Since the MAT file binary format
@@ -239,392 +368,3740 @@ struct is_uint64<unsigned long long>
                 (sizeof(unsigned long long) == 8);
 };
 
+/*
+ * Determine the MatLab data type of T, or 0 if it doesn't have
+ * one
+ */
+template <typename T>
+inline int mi_type()
+{
+    if (is_double<T>::value)
+        return miDOUBLE;
+    else if (is_float<T> ::value)
+        return miSINGLE;
+    else if (is_int64<T> ::value)
+        return miINT64;
+    else if (is_uint64<T>::value)
+        return miUINT64;
+    else if (is_int32<T> ::value)
+        return miINT32;
+    else if (is_uint32<T>::value)
+        return miUINT32;
+    else if (is_int16<T> ::value)
+        return miINT16;
+    else if (is_uint16<T>::value)
+        return miUINT16;
+    else if (is_int8<T>  ::value)
+        return miINT8;
+    else if (is_uint8<T> ::value)
+        return miUINT8;
+    else
+        return 0;
+}
+
 /**
  * A simple interface for outputting data that can be opened using
  * MatLab's load()
  */
 class MatFile
 {
-    /*
-     * Base class which allows us to polymorphically reference
-     * different Variable types
+public:
+
+    /**
+     * MAT file format to write
+     */
+    typedef enum
+    {
+        Level4, /**< Level 4 MAT files. These have the least overhead
+                     per write, but only support double, float, int32,
+                     int16, uint16 and uint8 data */
+        Level5  /**< Level 5 MAT files */
+    } format_t;
+
+    /**
+     * Options which can be given to create()
      */
-    class variable_base
+    typedef enum
     {
-    public:
-        virtual ~variable_base() {};
-    };
+        Compressed = 1, /**< Compress the variable. This requires building
+                             with MATFILE_USE_ZLIB defined, and is only
+                             available for Level 5 files */
+        Indexed    = 2, /**< Write a seek index alongside the variable
+                             (see set_index_stride()). This is ignored
+                             for compressed variables, whose restart
+                             points serve the same purpose */
+        Timestamped = 4, /**< Record the time each sample is written in
+                             a time column (see set_time_column()) */
+        Summarized = 8  /**< Keep min/max/mean summaries of the samples
+                             at several resolutions, for plotting (see
+                             set_summary_levels()) */
+    } option_t;
+
+    /**
+     * Ways in which a variable can reduce its samples before writing
+     * them (see create())
+     */
+    typedef enum
+    {
+        Decimate, /**< Keep every Nth sample */
+        Average,  /**< Keep the mean of every N samples */
+        Envelope  /**< Keep the minimum and maximum of every N samples,
+                       as the columns of a 2-row matrix */
+    } reduction_t;
+
+private:
 
     /*
-     * Represents an output variable of type T, which can be an
-     * int, float, etc.
+     * Runs file housekeeping (pre-creating the next part of a variable,
+     * closing finished parts) on a single background thread, so that
+     * none of it stalls the write path. The thread is only started the
+     * first time a task is posted
      */
-    template <class T>
-    class Variable : public variable_base
+    class background_worker
     {
     public:
 
-        Variable(const std::string& path, const std::string& name)
-            : _count(0),
-              _dim_tag_offset(0xA4), _mat_tag_offset(0x84),
-              _name(name)
+        background_worker()
+            : _done(false), _tasks()
         {
-            _fp = std::fopen((path +
-                              separator() + name + ".mat").c_str(),
-                             "wb");
+        }
 
-            if (!write_header() || !write_meta_data())
+        ~background_worker()
+        {
             {
-                std::fclose(_fp);
-                _fp = NULL;
+                std::lock_guard<std::mutex> lock(_mutex);
+                _done = true;
             }
+
+            _ready.notify_one();
+
+            if (_thread.joinable())
+                _thread.join();
         }
 
-        Variable(const Variable& copy)
-            : _dim_tag_offset(0xA4), _mat_tag_offset(0x84)
+        void post(const std::function<void()>& task)
         {
-            *this = copy;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _tasks.push_back(task);
+
+                if (!_thread.joinable())
+                    _thread = std::thread(&background_worker::run,
+                                          this);
+            }
+
+            _ready.notify_one();
         }
 
-        Variable& operator=(const Variable& rhs)
+    private:
+
+        void run()
         {
-            if (this == &rhs)
-                return *this;
+            std::unique_lock<std::mutex> lock(_mutex);
 
-            if (_fp)
-                std::fclose(_fp);
+            while (true)
+            {
+                _ready.wait(lock, [this] {
+                    return _done || !_tasks.empty(); });
 
-            _count = rhs._count;
-            _fp    = rhs._fp; rhs._fp = NULL;
-            _name  = rhs._name;
+                if (_tasks.empty())
+                    return;
 
-            _mat_tag_size  =
-                rhs._mat_tag_size;
-            _re_tag_offset =
-                    rhs._re_tag_offset;
+                std::function<void()> task = _tasks.front();
+                _tasks.pop_front();
 
-            return *this;
+                lock.unlock();
+                task();
+                lock.lock();
+            }
         }
 
-        ~Variable()
+        bool                              _done;
+        std::mutex                        _mutex;
+        std::condition_variable           _ready;
+        std::deque<std::function<void()>> _tasks;
+        std::thread                       _thread;
+    };
+
+    /*
+     * Divides wall-clock time into rotation periods. A background thread
+     * bumps the period number at each boundary, so variables can check
+     * whether it is time to rotate with a single atomic load. Rotation
+     * periods are aligned to multiples of the period since the epoch,
+     * e.g. hourly rotation happens on the hour
+     */
+    class rotation_timer
+    {
+    public:
+
+        rotation_timer(const std::string& index, unsigned int period)
+            : _index(index),
+              _period(period),
+              _stop(false)
         {
-            if (_fp)
-                std::fclose(_fp);
+            _epoch = std::time(NULL) / _period;
+            _thread = std::thread(&rotation_timer::run, this);
         }
 
-        bool write(const T& element)
+        ~rotation_timer()
         {
-            if (_fp == NULL)
-                return false;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
 
-            const size_t num =
-                std::fwrite( &element, sizeof(T), 1, _fp );
+            _wakeup.notify_one();
+            _thread.join();
+        }
 
-            _count += num;
-            return num == 1
-                && update_counters();
+        long epoch() const
+        {
+            return _epoch.load(std::memory_order_relaxed);
         }
 
-        size_t write(const T* data, size_t numel)
+        std::time_t start_of(long epoch) const
         {
-            if (_fp == NULL)
-                return 0;
+            return static_cast<std::time_t>(epoch) * _period;
+        }
+
+        /*
+         * Record that a file holds data from the wall-clock range
+         * [start, end). Each entry is appended with a single write,
+         * and only once the file is closed
+         */
+        void add_to_index(std::time_t start, std::time_t end,
+                          const std::string& file) const
+        {
+            char line[64];
+            std::snprintf(line, sizeof(line), "%lld %lld ",
+                          static_cast<long long>(start),
+                          static_cast<long long>(end));
 
-            const size_t num =
-                std::fwrite( data, sizeof(T), numel, _fp );
+            const std::string entry = line + file + "\n";
 
-            _count += num;
-            return num == numel
-                && update_counters();
+            FILE* out = std::fopen(_index.c_str(), "a");
+            if (out)
+            {
+                std::fwrite(entry.c_str(), sizeof(char),
+                            entry.size(), out);
+                std::fclose(out);
+            }
         }
 
-        bool write_header()
+    private:
+
+        void run()
         {
-            const size_t HEADER_SIZE = 124;
+            std::unique_lock<std::mutex> lock(_mutex);
 
-            time_t raw; std::time(&raw);
+            while (!_stop)
+            {
+                const std::chrono::system_clock::time_point next =
+                    std::chrono::system_clock::from_time_t(
+                        start_of(epoch() + 1));
 
-            char header[HEADER_SIZE];
+                _wakeup.wait_until(lock, next);
 
-            std::memset(header, 0,
-                            HEADER_SIZE);
+                _epoch.store(std::time(NULL) / _period,
+                             std::memory_order_relaxed);
+            }
+        }
 
-            std::string header_s =
-                        std::string("Name: ") + _name   +
-                        "\nFormat: MATLAB 5.0 MAT file" +
-                        "\nCreated: " + std::ctime(&raw);
+        std::atomic<long>       _epoch;
+        const std::string       _index;
+        std::mutex              _mutex;
+        const unsigned int      _period;
+        bool                    _stop;
+        std::thread             _thread;
+        std::condition_variable _wakeup;
+    };
 
-            const size_t num_bytes =
-                std::min( HEADER_SIZE, header_s.size() );
+    /*
+     * The source of sample timestamps. Reading CLOCK_MONOTONIC_COARSE
+     * costs a few nanoseconds, since it is served from the vDSO without
+     * entering the kernel, at the expense of a resolution of one timer
+     * tick (1-4 ms). Readings are turned into wall-clock time using the
+     * offset between the two clocks measured at construction, so they
+     * don't jump if the system clock is stepped
+     */
+    class sample_clock
+    {
+    public:
 
-            std::memcpy(header, header_s.c_str(),
-                        num_bytes);
+        sample_clock()
+            : _offset(wall_time() - monotonic_time())
+        {
+        }
 
-            const short version = 0x0100;
-            const short endian  =
-                        (('M') << 8) | 'I';
+        /*
+         * Get the time, in seconds since the epoch
+         */
+        double now() const
+        {
+            return monotonic_time() + _offset;
+        }
 
-            int numel = std::fwrite(header, sizeof(char),
-                                    HEADER_SIZE, _fp);
+    private:
 
-            numel += std::fwrite(&version, sizeof(short),
-                                 1, _fp);
-            numel += std::fwrite(&endian , sizeof(short),
-                                 1, _fp);
+        static double monotonic_time()
+        {
+#ifdef CLOCK_MONOTONIC_COARSE
+            struct timespec ts;
+            ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
 
-            return
-                numel == 126;
+            return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+            return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+#endif
         }
 
-        bool write_meta_data()
+        static double wall_time()
         {
-            /*
-             * Write the matrix tag and array flags subelement:
-             */
-            int bytes = ARRAY_FLAGS_SIZE    +
-                        DIM_ARRAY_SIZE      +
-                        ARRAY_NAME_TAG_SIZE +
-                        _name.size()        +
-                        RE_TAG_SIZE;
+            return std::chrono::duration<double>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count();
+        }
 
-            if (_name.size() % 8)
-                bytes +=  8-(_name.size() % 8);
+        const double _offset;
+    };
 
-            _mat_tag_size = bytes;
+    class buffer_pool;
 
-            int dword[4] =
-                {miMATRIX, bytes, miUINT32, 8};
+    /*
+     * Anything that can lease a slab from a buffer_pool
+     */
+    class buffer_client
+    {
+    public:
 
-            if (std::fwrite( dword, sizeof(int), 4, _fp ) != 4)
-                return false;
+        virtual ~buffer_client()
+        {
+        }
 
-            int miType;
-
-            /*
-             * Determine the array flags class element:
-             */
-            if (is_double<T>::value)
-                miType = miDOUBLE;
-            else if (is_float<T> ::value)
-                miType = miSINGLE;
-            else if (is_int64<T> ::value)
-                miType = miINT64;
-            else if (is_uint64<T>::value)
-                miType = miUINT64;
-            else if (is_int32<T> ::value)
-                miType = miINT32;
-            else if (is_uint32<T>::value)
-                miType = miUINT32;
-            else if (is_int16<T> ::value)
-                miType = miINT16;
-            else if (is_uint16<T>::value)
-                miType = miUINT16;
-            else if (is_int8<T>  ::value)
-                miType = miINT8;
-            else if (is_uint8<T> ::value)
-                miType = miUINT8;
-            else
-                return false;
+        /*
+         * Write out whatever is in our slab, and give it back
+         */
+        virtual void reclaim() = 0;
 
-            const int arrayFlags[] =
-                         { mi2mx[miType], 0, 0, 0, 0, 0, 0, 0 };
+    private:
 
-            if (std::fwrite(arrayFlags,sizeof(char),8,_fp) != 8)
-                return false;
+        friend class buffer_pool;
 
-            /*
-             * Dimensions array subelement:
-             */
-            dword[0] = miINT32;
-            dword[1] = 8;
-            dword[2] = 1;
-            dword[3] = 0;
+        std::list<buffer_client*>::iterator _lease;
+    };
 
-            if ( std::fwrite( dword, sizeof(int), 4, _fp ) != 4)
-                return false;
+    /*
+     * A pool of fixed-size slabs in which variables buffer their writes,
+     * shared by the whole MatFile. Slabs are allocated as needed until
+     * the budget is reached; after that, a slab is taken back from the
+     * client which has held one the longest. The pool is only used from
+     * the thread writing to the MatFile
+     */
+    class buffer_pool
+    {
+    public:
 
-            /*
-             * Array name subelement:
-             */
-             dword[0] = miINT8;
-             dword[1] = _name.size();
+        buffer_pool(size_t budget, size_t slab_size)
+            : _budget(budget),
+              _free(),
+              _leased(0),
+              _leases(),
+              _slab_size(std::max<size_t>(slab_size, 1)),
+              _slabs()
+        {
+        }
 
-            if ( std::fwrite( dword, sizeof(int), 2, _fp ) != 2)
-                return false;
+        size_t budget() const
+        {
+            return _budget;
+        }
 
-            if ( std::fwrite(_name.c_str(), sizeof(char),
-                             _name.size() , _fp) !=_name.size())
-                return false;
+        size_t slab_size() const
+        {
+            return _slab_size;
+        }
 
+        /*
+         * Get the number of bytes in leased slabs
+         */
+        size_t usage() const
+        {
+            return _leased;
+        }
 
-            const int rem = _name.size() % 8;
-            if (rem)
+        /*
+         * Lease a slab to a client which doesn't have one. This returns
+         * NULL if the budget can't fit a single slab
+         */
+        unsigned char* lease(buffer_client* client)
+        {
+            if (_free.empty() &&
+                (_slabs.size() + 1) * _slab_size > _budget)
             {
-                // Add padding to the name to make sure it aligns
-                // on an 8-byte boundary:
-                char pad[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+                if (_leases.empty())
+                    return NULL;
 
-                if (std::fwrite(pad, sizeof(char), 8-rem, _fp) !=
-                    (size_t)(8-rem))
-                        return false ;
+                _leases.front()->reclaim();
             }
 
-            /*
-             * Real part subelement:
-             */
-             dword[0] = miType;
-             dword[1] = 0;
-
-             if ( std::fwrite( dword, sizeof(int), 2, _fp ) != 2)
-                return false;
+            unsigned char* slab;
 
-            /*
-             * Save the location of the number of bytes in the real
-             * part subelement. We'll update this value as we write
-             * data samples to the file
-             */
-            _re_tag_offset = std::ftell(_fp );
-            if (_re_tag_offset == -1)
-                return false;
+            if (_free.empty())
+            {
+                _slabs.emplace_back(new unsigned char[_slab_size]);
+                slab = _slabs.back().get();
+            }
             else
-                _re_tag_offset -= sizeof(int);
+            {
+                slab = _free.back();
+                _free.pop_back();
+            }
 
-            return true;
+            client->_lease = _leases.insert(_leases.end(), client);
+            _leased += _slab_size;
+
+            return slab;
+        }
+
+        void release(buffer_client* client, unsigned char* slab)
+        {
+            _leases.erase(client->_lease);
+            _free.push_back(slab);
+            _leased -= _slab_size;
         }
 
     private:
 
-        bool update_counters()
-        {
-            long curr = std::ftell(_fp);
-            if (curr == -1)
-                return false;
+        const size_t                                  _budget;
+        std::vector<unsigned char*>                   _free;
+        size_t                                        _leased;
+        std::list<buffer_client*>                     _leases;
+        const size_t                                  _slab_size;
+        std::vector<std::unique_ptr<unsigned char[]>> _slabs;
+    };
 
-            size_t bytes = _mat_tag_size + _count * sizeof(T);
-            size_t rem = bytes % 8;
-            if (rem)
-                bytes += (8 - rem);
+    class file_cache;
 
-            if (std::fseek(_fp,_mat_tag_offset,SEEK_SET))
-                return false;
-            if (std::fwrite(&bytes, sizeof(size_t), 1, _fp)
-                != 1)
-                return false;
+    /*
+     * Anything whose file can be closed by a file_cache
+     */
+    class file_client
+    {
+    public:
 
-            if (std::fseek(_fp,_dim_tag_offset,SEEK_SET))
-                return false;
-            if (std::fwrite(&_count,sizeof(size_t), 1, _fp)
-                != 1)
-                return false;
+        file_client()
+            : _cached(false)
+        {
+        }
 
-            bytes = _count * sizeof(T);
+        virtual ~file_client()
+        {
+        }
 
-            if (std::fseek(_fp,_re_tag_offset, SEEK_SET))
-                return false;
-            if (std::fwrite(&bytes, sizeof(size_t), 1, _fp)
-                != 1)
-                return false;
+        /*
+         * Close our file, remembering where we were, so that it can be
+         * reopened the next time it is needed
+         */
+        virtual void close_file() = 0;
 
-            if (std::fseek(_fp, curr, SEEK_SET))
-                return false;
+    private:
 
-            if (rem)
-            {
-                /*
-                 * Add padding to make sure the data aligns on
-                 * an 8-byte boundary in case this is the last
-                 * write:
-                 */
-                const char zeros[8] = {0};
-                if (std::fwrite(&zeros,sizeof(char),8-rem,_fp)
-                    != 8-rem)
-                    return false;
-                if ( std::fseek(  _fp, curr, SEEK_SET ) != 0 )
-                    return false;
-            }
+        friend class file_cache;
 
-            return true;
+        bool                              _cached;
+        std::list<file_client*>::iterator _entry;
+    };
+
+    /*
+     * Limits how many variables have their file open at once. Files
+     * are kept in order of use, and once the limit is reached the least
+     * recently used one is closed to make room. Like buffer_pool, this
+     * is only used from the thread writing to the MatFile
+     */
+    class file_cache
+    {
+    public:
+
+        /*
+         * @param[in] limit The maximum number of open files. This must
+         *                  be at least 2, so that a variable reopening
+         *                  its file can't close that of the variable
+         *                  which (indirectly) caused it to
+         */
+        explicit file_cache(size_t limit)
+            : _limit(std::max<size_t>(limit, 2)), _open()
+        {
+        }
+
+        size_t limit() const
+        {
+            return _limit;
+        }
+
+        /*
+         * Note that a client's file is open and has just been used
+         */
+        void touch(file_client* client)
+        {
+            if (client->_cached)
+            {
+                _open.splice(_open.end(), _open, client->_entry);
+                return;
+            }
+
+            if (_open.size() >= _limit)
+            {
+                file_client* oldest = _open.front();
+
+                remove(oldest);
+                oldest->close_file();
+            }
+
+            client->_entry  = _open.insert(_open.end(), client);
+            client->_cached = true;
+        }
+
+        /*
+         * Forget a client whose file is being closed for good
+         */
+        void remove(file_client* client)
+        {
+            if (client->_cached)
+            {
+                _open.erase(client->_entry);
+                client->_cached = false;
+            }
+        }
+
+    private:
+
+        const size_t            _limit;
+        std::list<file_client*> _open;
+    };
+
+    class time_columns;
+
+    /*
+     * Settings shared by all the variables of a MatFile
+     */
+    struct var_settings
+    {
+        const sample_clock* clock;
+        std::string         dir;
+        file_cache*         files;
+        format_t            format;
+        size_t              index_stride;
+        size_t              max_part_size;
+        buffer_pool*        pool;
+        size_t              post_trigger;
+        size_t              pre_trigger;
+        size_t              restart_interval;
+        rotation_timer*     rotation;
+        size_t              summary_block;
+        unsigned int        summary_levels;
+        std::string         time_column;
+        time_columns*       timestamps;
+        bool                triggered;
+        background_worker*  worker;
+    };
+
+    /*
+     * Compresses the data of one part of a compressed variable. The
+     * part is a single miCOMPRESSED element holding a zlib stream, in
+     * which the matrix header is kept in a stored (uncompressed) block
+     * so that its size fields can be updated in place. Samples are
+     * deflated restart_interval bytes at a time, with a full flush in
+     * between. Each flush is a restart point from which the rest of the
+     * data can be inflated on its own
+     */
+#ifdef MATFILE_USE_ZLIB
+    class part_deflater
+    {
+    public:
+
+        /*
+         * @param[in] restart_interval Bytes of data between restarts
+         * @param[in] data_offset      Where the deflated data starts
+         *                             in the file
+         */
+        part_deflater(size_t restart_interval, size_t data_offset)
+            : _adler(::adler32(0, NULL, 0)),
+              _data_bytes(0),
+              _file_pos(data_offset),
+              _restarts(),
+              _staged()
+        {
+            std::memset(&_zstream, 0, sizeof(_zstream));
+
+            _ok = ::deflateInit2(&_zstream, Z_BEST_SPEED, Z_DEFLATED,
+                                 -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+            _staged.reserve(std::max<size_t>(restart_interval, 1));
+            _out.resize(::deflateBound(&_zstream,
+                                       _staged.capacity()) + 64);
+
+            _restarts.push_back(0);
+            _restarts.push_back(data_offset);
+        }
+
+        ~part_deflater()
+        {
+            ::deflateEnd(&_zstream);
+        }
+
+        static bool available()
+        {
+            return true;
+        }
+
+        bool write(FILE* fp, const void* data, size_t bytes)
+        {
+            const unsigned char* ptr =
+                static_cast<const unsigned char*>(data);
+
+            while (_ok && bytes > 0)
+            {
+                const size_t todo =
+                    std::min(bytes,
+                             _staged.capacity() - _staged.size());
+
+                _staged.insert(_staged.end(), ptr, ptr + todo);
+                ptr   += todo;
+                bytes -= todo;
+
+                if (_staged.size() == _staged.capacity())
+                {
+                    _ok = deflate_staged(fp, Z_FULL_FLUSH);
+
+                    _restarts.push_back(_data_bytes);
+                    _restarts.push_back(_file_pos);
+                }
+            }
+
+            return _ok;
+        }
+
+        /*
+         * Deflate whatever is left, followed by pad bytes of padding,
+         * and end the stream
+         */
+        bool finish(FILE* fp, size_t pad)
+        {
+            const unsigned char zeros[8] = {0};
+            _staged.insert(_staged.end(), zeros, zeros + pad);
+
+            _ok = _ok && deflate_staged(fp, Z_FINISH);
+
+            _restarts.push_back(_data_bytes);
+            _restarts.push_back(_file_pos);
+
+            return _ok;
+        }
+
+        /*
+         * Write the zlib checksum, given the (final) matrix header at
+         * header_offset, and fill in the size of the miCOMPRESSED
+         * element whose tag is at tag_offset
+         */
+        bool write_trailer(FILE* fp, long tag_offset, long header_offset,
+                           size_t header_bytes)
+        {
+            std::vector<unsigned char> header(header_bytes);
+
+            if (!_ok || std::fflush(fp) ||
+                std::fseek(fp, header_offset, SEEK_SET) ||
+                std::fread(header.data(), 1, header_bytes, fp)
+                    != header_bytes)
+                return false;
+
+            const uLong adler =
+                ::adler32_combine(::adler32(::adler32(0, NULL, 0),
+                                            header.data(),
+                                            header_bytes),
+                                  _adler, _data_bytes);
+
+            const unsigned char trailer[4] =
+                { static_cast<unsigned char>(adler >> 24),
+                  static_cast<unsigned char>(adler >> 16),
+                  static_cast<unsigned char>(adler >>  8),
+                  static_cast<unsigned char>(adler) };
+
+            const std::uint32_t size = static_cast<std::uint32_t>(
+                _file_pos + sizeof(trailer) - (tag_offset + 8));
+
+            return std::fseek(fp, _file_pos, SEEK_SET) == 0
+                && std::fwrite(trailer, 1, sizeof(trailer), fp) == 4
+                && std::fseek(fp, tag_offset + 4, SEEK_SET) == 0
+                && std::fwrite(&size, sizeof(size), 1, fp) == 1;
+        }
+
+        /*
+         * Restart points, as pairs of (offset into the data, offset in
+         * the file). The last pair marks the end of the data
+         */
+        const std::vector<std::uint64_t>& restarts() const
+        {
+            return _restarts;
+        }
+
+    private:
+
+        bool deflate_staged(FILE* fp, int flush)
+        {
+            _adler = ::adler32(_adler, _staged.data(), _staged.size());
+            _data_bytes += _staged.size();
+
+            _zstream.next_in  = _staged.data();
+            _zstream.avail_in = _staged.size();
+
+            int ret;
+            do
+            {
+                _zstream.next_out  = _out.data();
+                _zstream.avail_out = _out.size();
+
+                ret = ::deflate(&_zstream, flush);
+                if (ret == Z_STREAM_ERROR)
+                    return false;
+
+                const size_t num = _out.size() - _zstream.avail_out;
+                if (std::fwrite(_out.data(), 1, num, fp) != num)
+                    return false;
+
+                _file_pos += num;
+            }
+            while (_zstream.avail_out == 0 ||
+                   (flush == Z_FINISH && ret != Z_STREAM_END));
+
+            _staged.clear();
+            return true;
+        }
+
+        uLong                      _adler;
+        size_t                     _data_bytes;
+        size_t                     _file_pos;
+        bool                       _ok;
+        std::vector<unsigned char> _out;
+        std::vector<std::uint64_t> _restarts;
+        std::vector<unsigned char> _staged;
+        z_stream                   _zstream;
+    };
+#else
+    class part_deflater
+    {
+    public:
+
+        part_deflater(size_t, size_t)
+            : _restarts()
+        {
+        }
+
+        static bool available()
+        {
+            return false;
+        }
+
+        bool write(FILE*, const void*, size_t)
+        {
+            return false;
+        }
+
+        bool finish(FILE*, size_t)
+        {
+            return false;
+        }
+
+        bool write_trailer(FILE*, long, long, size_t)
+        {
+            return false;
+        }
+
+        const std::vector<std::uint64_t>& restarts() const
+        {
+            return _restarts;
+        }
+
+    private:
+
+        std::vector<std::uint64_t> _restarts;
+    };
+#endif
+
+    /*
+     * One entry in the seek index of a variable: a sample number
+     * within a part, the offset of that sample in the part, and the
+     * wall-clock time (in seconds since the epoch) it was written at
+     */
+    struct index_entry
+    {
+        std::uint64_t sample;
+        std::uint64_t offset;
+        double        time;
+    };
+
+    /*
+     * Reduces a variable's samples before they are written. Samples
+     * are handled a block of N at a time, where the loops over each
+     * block are simple enough for the compiler to vectorize
+     */
+    class reducer_base
+    {
+    public:
+
+        virtual ~reducer_base() {}
+
+        /*
+         * Reduce numel samples, replacing the contents of out with the
+         * samples to write. Blocks may span calls
+         */
+        virtual void reduce(const void* data, size_t numel,
+                            std::vector<unsigned char>& out) = 0;
+
+        /*
+         * Reduce what there is of the last block, if it is incomplete
+         */
+        virtual void finish(std::vector<unsigned char>& out) = 0;
+    };
+
+    template <class T>
+    class reducer : public reducer_base
+    {
+    public:
+
+        reducer(reduction_t reduction, size_t factor)
+            : _factor(std::max<size_t>(factor, 1)),
+              _filled(0),
+              _max(),
+              _min(),
+              _reduction(reduction),
+              _sum(0)
+        {
+        }
+
+        void reduce(const void* data, size_t numel,
+                    std::vector<unsigned char>& out) override
+        {
+            const T* in = static_cast<const T*>(data);
+
+            /*
+             * out belongs to the variable and is reused from one write
+             * to the next, so this only allocates while it grows:
+             */
+            out.resize(2 * (numel / _factor + 1) * sizeof(T));
+            size_t count = 0;
+
+            while (numel > 0)
+            {
+                const size_t todo = std::min(numel, _factor - _filled);
+
+                if (_reduction == Decimate)
+                {
+                    if (_filled == 0)
+                        put(in[0], out, count);
+                }
+                else
+                    accumulate(in, todo);
+
+                _filled += todo;
+                in      += todo;
+                numel   -= todo;
+
+                if (_filled == _factor)
+                    end_block(out, count);
+            }
+
+            out.resize(count * sizeof(T));
+        }
+
+        void finish(std::vector<unsigned char>& out) override
+        {
+            out.resize(2 * sizeof(T));
+            size_t count = 0;
+
+            if (_filled > 0 && _reduction != Decimate)
+                end_block(out, count);
+
+            out.resize(count * sizeof(T));
+        }
+
+    private:
+
+        void accumulate(const T* in, size_t numel)
+        {
+            if (_reduction == Average)
+            {
+                double sum = 0;
+                for (size_t i = 0; i < numel; i++)
+                    sum += in[i];
+
+                _sum += sum;
+                return;
+            }
+
+            T lo = _filled ? _min : in[0];
+            T hi = _filled ? _max : in[0];
+
+            for (size_t i = 0; i < numel; i++)
+            {
+                lo = std::min(lo, in[i]);
+                hi = std::max(hi, in[i]);
+            }
+
+            _min = lo;
+            _max = hi;
+        }
+
+        void end_block(std::vector<unsigned char>& out, size_t& count)
+        {
+            if (_reduction == Average)
+                put(static_cast<T>(_sum / _filled), out, count);
+            else if (_reduction == Envelope)
+            {
+                put(_min, out, count);
+                put(_max, out, count);
+            }
+
+            _filled = 0;
+            _sum    = 0;
+        }
+
+        /*
+         * Store the count'th reduced sample in out, which has room
+         */
+        static void put(const T& value, std::vector<unsigned char>& out,
+                        size_t& count)
+        {
+            std::memcpy(&out[count * sizeof(T)], &value, sizeof(T));
+            count++;
+        }
+
+        const size_t      _factor;
+        size_t            _filled;
+        T                 _max;
+        T                 _min;
+        const reduction_t _reduction;
+        double            _sum;
+    };
+
+    /*
+     * Keeps summaries of a variable's samples (see Summarized)
+     */
+    class summarizer_base
+    {
+    public:
+
+        virtual ~summarizer_base() {}
+
+        /*
+         * Get the names of the summary variables of a variable, one per
+         * level, and the block size of each level
+         */
+        static std::vector<std::pair<std::string, size_t> > levels(
+            const var_settings& settings, const std::string& name)
+        {
+            std::vector<std::pair<std::string, size_t> > named;
+
+            size_t block = 1;
+            while (block < settings.summary_block)
+                block *= 2;
+
+            for (unsigned int i = 0; i < settings.summary_levels; i++)
+            {
+                named.emplace_back(name + "_summary" +
+                                   std::to_string(block << i),
+                                   block << i);
+            }
+
+            return named;
+        }
+
+        /*
+         * Summarize numel more samples
+         */
+        virtual void add(const void* data, size_t numel) = 0;
+
+        /*
+         * Summarize what there is of the last block at each level
+         */
+        virtual void finish() = 0;
+    };
+
+    /*
+     * Represents an output variable whose samples are of the MatLab
+     * data type (miDOUBLE, miINT16, etc.) it was constructed with. It
+     * only deals in raw samples, so one instantiation serves every
+     * type. Variable<T> adds type safety on top, and variables whose
+     * type is only known at runtime use this directly
+     *
+     * The size fields of a Level 5 MAT file are only 32 bits wide, so
+     * a variable is split into parts of at most max_part_bytes bytes.
+     * The first part is called <name>.mat, and subsequent ones are
+     * <name>_part002.mat, <name>_part003.mat, etc. Each part is a
+     * complete MAT file holding a variable called <name>. Once a
+     * variable spans more than one part, <name>.manifest lists the
+     * range of samples stored in each. If the MatFile rotates its
+     * output on a schedule, a variable also moves on to a new part at
+     * the start of each rotation period
+     *
+     * A Level 4 variable has a single 20-byte header, in which only the
+     * number of columns needs updating as we write
+     *
+     * A compressed variable is deflated as it is written (see
+     * part_deflater), and its sizes are only filled in once a part is
+     * finished, so each part becomes loadable when it is closed. The
+     * restart points of each part are saved next to it in <part>.rst,
+     * as native 64-bit pairs of (offset into the data, offset in the
+     * file). The last pair marks the end of the data
+     *
+     * An indexed variable records an index_entry for every stride'th
+     * sample of each part, which is appended to <part>.idx in batches
+     * by the background worker
+     *
+     * A variable with a reducer only writes what the reducer makes of
+     * its samples. Its matrix has the given number of rows, which are
+     * filled a column at a time. A summarized variable passes what it
+     * writes on to its summarizer
+     */
+    class variable_base : public buffer_client, public file_client
+    {
+    public:
+
+        variable_base(const var_settings& settings,
+                      const std::string& name, int options, int type,
+                      int rows = 1)
+            : _capture(),
+              _capture_index(0),
+              _capturing(false),
+              _clock(settings.clock),
+              _compressed((options & Compressed) != 0),
+              _count(0),
+              _deflater(),
+              _dim_tag_offset(0xA4 + prefix_size(options)),
+              _evicted(false),
+              _file_pos(0),
+              _files(settings.files),
+              _format(settings.format),
+              _fp(NULL),
+              _index_entries(),
+              _index_next(0),
+              _index_started(false),
+              _mat_tag_offset(0x84 + prefix_size(options)),
+              _name(name),
+              _next_pending(false),
+              _options(options),
+              _part_count(0),
+              _part_epoch(0),
+              _part_first(0),
+              _part_index(1),
+              _part_start(std::time(NULL)),
+              _path(settings.dir),
+              _pool((options & Compressed) ? NULL : settings.pool),
+              _post_left(0),
+              _post_trigger(settings.post_trigger),
+              _reduced(),
+              _reducer(),
+              _restart_interval(settings.restart_interval),
+              _ring(),
+              _ring_count(0),
+              _ring_next(0),
+              _rotation(settings.rotation),
+              _rows(std::max(rows, 1)),
+              _sample_size(mi_type_size(type)),
+              _settings(settings),
+              _slab(NULL),
+              _slab_used(0),
+              _stale(false),
+              _summarizer(),
+              _time(),
+              _triggered(settings.triggered),
+              _type(type),
+              _unopened(false),
+              _worker(settings.worker)
+        {
+            _mat_tag_size = meta_data_size(name);
+
+            if ((options & Timestamped) && !_triggered)
+            {
+                _time = settings.timestamps->get(
+                    settings, time_columns::column_name(settings, name));
+            }
+
+            /*
+             * Header, matrix tag, then everything in the matrix up to
+             * the number of bytes in the real part subelement:
+             */
+            _re_tag_offset = 128 + prefix_size(options) + 8 +
+                             _mat_tag_size - sizeof(int);
+
+            _data_offset = _format == Level4 ?
+                LEVEL4_HEADER_SIZE + name.size() + 1 :
+                _re_tag_offset + sizeof(int);
+
+            _index_stride = (options & Indexed) && !_compressed ?
+                std::max<size_t>(settings.index_stride, 1) : 0;
+
+            /*
+             * Every part has to hold at least one column, however
+             * small the maximum part size:
+             */
+            const size_t min_part_bytes =
+                (_data_offset + _rows * _sample_size + 7) & ~size_t(7);
+
+            size_t max_part_bytes = std::min<size_t>(
+                std::max(settings.max_part_size, min_part_bytes),
+                0x7FFFFFFF);
+            max_part_bytes -= max_part_bytes % 8;
+
+            _part_capacity = max_part_bytes > _data_offset &&
+                _sample_size > 0 ?
+                (max_part_bytes - _data_offset) / _sample_size : 0;
+
+            /*
+             * Columns mustn't be split between parts:
+             */
+            _part_capacity -= _part_capacity % _rows;
+
+            /*
+             * A triggered variable only keeps its most recent samples
+             * until a trigger, so it has no file yet. Allocate (and
+             * touch) the ring now rather than on the first write:
+             */
+            if (_triggered)
+            {
+                _ring.assign(settings.pre_trigger * _sample_size, 0);
+                return;
+            }
+
+            if (_compressed && (_format == Level4 ||
+                                !part_deflater::available()))
+                return;
+
+            /*
+             * Many variables are never written, so we wait for the
+             * first sample before creating a file:
+             */
+            _unopened = true;
+        }
+
+        variable_base(const variable_base& copy)            = delete;
+        variable_base& operator=(const variable_base& rhs) = delete;
+
+        virtual ~variable_base()
+        {
+            if (_reducer && (has_file() || _triggered))
+            {
+                _reducer->finish(_reduced);
+                append(_reduced.data(), _reduced.size() / _sample_size,
+                       true);
+            }
+
+            /*
+             * Save whatever we have captured so far after a trigger:
+             */
+            if (_capturing)
+                dump();
+
+            if (_summarizer)
+                _summarizer->finish();
+
+            if (_next_pending)
+            {
+                /*
+                 * We pre-created a part that never got used, so
+                 * get rid of it:
+                 */
+                std::shared_future<FILE*> next = _next;
+                const std::string file =
+                    part_file(_part_index + 1);
+
+                run_in_background([next, file] {
+                    if (next.get())
+                    {
+                        std::fclose(next.get());
+                        std::remove(file.c_str());
+                    }
+                });
+            }
+
+            if (_fp || _evicted)
+                retire(_part_index > 1, std::time(NULL));
+
+            /*
+             * We may still have a slab if our file was lost earlier:
+             */
+            if (_slab)
+                reclaim();
+        }
+
+        /*
+         * Get the number of samples written
+         */
+        size_t count() const
+        {
+            return _count;
+        }
+
+        /*
+         * Get the MatLab data type of the samples
+         */
+        int type() const
+        {
+            return _type;
+        }
+
+        /*
+         * Write numel samples of our type, returning how many were
+         * written. If update is false, the sizes in the header are
+         * left for flush() to update (or for when the part is closed)
+         */
+        size_t write(const void* data, size_t numel, bool update = true)
+        {
+            if (!_reducer)
+                return append(data, numel, update);
+
+            if (!has_file() && !_triggered)
+                return 0;
+
+            _reducer->reduce(data, numel, _reduced);
+
+            const size_t reduced = _reduced.size() / _sample_size;
+
+            return append(_reduced.data(), reduced, update) == reduced ?
+                numel : 0;
+        }
+
+        /*
+         * Reduce samples before writing them. This takes ownership of
+         * the reducer
+         */
+        void set_reducer(reducer_base* reducer)
+        {
+            _reducer.reset(reducer);
+        }
+
+        /*
+         * Summarize samples as they are written. This takes ownership
+         * of the summarizer
+         */
+        void set_summarizer(summarizer_base* summarizer)
+        {
+            _summarizer.reset(summarizer);
+        }
+
+        /*
+         * Whether our first part is yet to be created
+         */
+        bool needs_file() const
+        {
+            return _unopened;
+        }
+
+        /*
+         * Create our first part ahead of the first write, on behalf of
+         * MatFile::create_many(). This doesn't change anything, so many
+         * variables can do it at once on different threads. The part is
+         * created relative to dir, an open descriptor of the output
+         * directory (if it is >= 0), and handed to adopt_file(). If we
+         * are in a file cache, it is closed straight away, and end
+         * gives where to reopen it
+         *
+         * @param[in] created The creation time to put in the header
+         */
+        FILE* prepare_file(int dir, const std::string& created,
+                           long& end) const
+        {
+            const std::string file = part_file(_part_index);
+            const char*       mode = _compressed ? "w+b" : "wb";
+
+            FILE* fp = NULL;
+#ifndef _WIN32
+            if (dir >= 0)
+            {
+                const std::string leaf =
+                    file.substr(_path.size() + 1);
+
+                const int fd = ::openat(dir, leaf.c_str(),
+                    (_compressed ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC,
+                    0666);
+
+                if (fd >= 0 && !(fp = ::fdopen(fd, mode)))
+                    ::close(fd);
+            }
+            else
+#endif
+                fp = std::fopen(file.c_str(), mode);
+
+            if (fp && !start_part(fp, _name, _type, _rows, _format,
+                                  _compressed, _pool == NULL,
+                                  created.c_str()))
+            {
+                std::fclose(fp);
+                std::remove(file.c_str());
+                fp = NULL;
+            }
+
+            end = -1;
+
+            if (fp && _files)
+            {
+                end = std::ftell(fp);
+
+                if (std::fclose(fp) != 0)
+                    end = -1;
+                fp = NULL;
+            }
+
+            return fp;
+        }
+
+        /*
+         * Take over the part made by prepare_file()
+         */
+        void adopt_file(FILE* fp, long end)
+        {
+            _unopened = false;
+            _fp       = fp;
+
+            if (!fp && end >= 0)
+            {
+                _evicted  = true;
+                _file_pos = end;
+            }
+
+            file_created();
+        }
+
+        /*
+         * Start capturing after a trigger (in Triggered mode). The
+         * samples in the ring, then the next post_trigger samples, are
+         * written to <dir>/trigger<index>/<name>.mat in the background.
+         * This returns false if we are still capturing after the last
+         * trigger
+         */
+        bool trigger(int index)
+        {
+            if (!_triggered || _capturing || _sample_size == 0)
+                return false;
+
+            /*
+             * Unroll the ring, oldest sample first:
+             */
+            const size_t capacity = _ring.size() / std::max<size_t>(
+                                        _sample_size, 1);
+            const size_t oldest   = _ring_count < capacity ?
+                                        0 : _ring_next;
+
+            _capture.clear();
+            _capture.reserve((_ring_count + _post_trigger) *
+                             _sample_size);
+
+            _capture.insert(_capture.end(),
+                            _ring.begin() + oldest * _sample_size,
+                            _ring.begin() + _ring_count * _sample_size);
+            _capture.insert(_capture.end(), _ring.begin(),
+                            _ring.begin() + oldest * _sample_size);
+
+            _capture_index = index;
+            _capturing     = true;
+            _post_left     = _post_trigger;
+
+            if (_post_left == 0)
+                dump();
+
+            return true;
+        }
+
+        /*
+         * Update the sizes in the header (and those of our time column),
+         * if writes have left them out of date
+         */
+        bool flush()
+        {
+            return (!_stale || (use_file() && update_counters())) &&
+                (!_time || _time->flush());
+        }
+
+        /*
+         * Get the time of creation to put in file headers
+         */
+        static std::string created_now()
+        {
+            time_t raw; std::time(&raw);
+
+            return std::ctime(&raw);
+        }
+
+        static bool write_header(FILE* fp, const std::string& name,
+                                 const char* created = NULL)
+        {
+            const size_t HEADER_SIZE = 124;
+
+            char header[HEADER_SIZE];
+
+            std::memset(header, 0,
+                            HEADER_SIZE);
+
+            std::string header_s =
+                        std::string("Name: ") + name    +
+                        "\nFormat: MATLAB 5.0 MAT file" +
+                        "\nCreated: " +
+                        (created ? created : created_now());
+
+            const size_t num_bytes =
+                std::min( HEADER_SIZE, header_s.size() );
+
+            std::memcpy(header, header_s.c_str(),
+                        num_bytes);
+
+            const short version = 0x0100;
+            const short endian  =
+                        (('M') << 8) | 'I';
+
+            int numel = std::fwrite(header, sizeof(char),
+                                    HEADER_SIZE, fp);
+
+            numel += std::fwrite(&version, sizeof(short),
+                                 1, fp);
+            numel += std::fwrite(&endian , sizeof(short),
+                                 1, fp);
+
+            return
+                numel == 126;
+        }
+
+        static bool write_meta_data(FILE* fp, const std::string& name,
+                                    int type, int rows)
+        {
+            /*
+             * Write the matrix tag and array flags subelement:
+             */
+            int dword[4] =
+                {miMATRIX, static_cast<int>(meta_data_size(name)),
+                 miUINT32, 8};
+
+            if (std::fwrite( dword, sizeof(int), 4, fp ) != 4)
+                return false;
+
+            const int miType = type;
+            if (mi_type_size(miType) == 0)
+                return false;
+
+            /*
+             * Array flags class element:
+             */
+            const int arrayFlags[] =
+                         { mi2mx[miType], 0, 0, 0, 0, 0, 0, 0 };
+
+            if (std::fwrite(arrayFlags,sizeof(char),8,fp) != 8)
+                return false;
+
+            /*
+             * Dimensions array subelement:
+             */
+            dword[0] = miINT32;
+            dword[1] = 8;
+            dword[2] = rows;
+            dword[3] = 0;
+
+            if ( std::fwrite( dword, sizeof(int), 4, fp ) != 4)
+                return false;
+
+            /*
+             * Array name subelement:
+             */
+             dword[0] = miINT8;
+             dword[1] = name.size();
+
+            if ( std::fwrite( dword, sizeof(int), 2, fp ) != 2)
+                return false;
+
+            if ( std::fwrite(name.c_str(), sizeof(char),
+                             name.size() , fp) != name.size())
+                return false;
+
+
+            const int rem = name.size() % 8;
+            if (rem)
+            {
+                // Add padding to the name to make sure it aligns
+                // on an 8-byte boundary:
+                char pad[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+                if (std::fwrite(pad, sizeof(char), 8-rem, fp) !=
+                    (size_t)(8-rem))
+                        return false ;
+            }
+
+            /*
+             * Real part subelement. The number of bytes gets updated
+             * as we write data samples to the file:
+             */
+             dword[0] = miType;
+             dword[1] = 0;
+
+             if ( std::fwrite( dword, sizeof(int), 2, fp ) != 2)
+                return false;
+
+            return true;
+        }
+
+        static bool write_compressed_prefix(FILE* fp,
+                                            const std::string& name)
+        {
+            /*
+             * The miCOMPRESSED tag, whose size is filled in once the
+             * part is finished:
+             */
+            const int tag[2] = { miCOMPRESSED, 0 };
+
+            if (std::fwrite(tag, sizeof(int), 2, fp) != 2)
+                return false;
+
+            /*
+             * zlib header (deflate, 32K window, fastest compression),
+             * followed by the header of a stored block which contains
+             * the matrix header:
+             */
+            const unsigned short len =
+                static_cast<unsigned short>(8 + meta_data_size(name));
+
+            const unsigned char prefix[] =
+                { 0x78, 0x01, 0x00,
+                  static_cast<unsigned char>(len & 0xFF),
+                  static_cast<unsigned char>(len >> 8),
+                  static_cast<unsigned char>(~len & 0xFF),
+                  static_cast<unsigned char>(~len >> 8) };
+
+            return std::fwrite(prefix, 1, sizeof(prefix), fp) ==
+                sizeof(prefix);
+        }
+
+        static bool write_level4_header(FILE* fp, const std::string& name,
+                                        int type, int rows)
+        {
+            /*
+             * Determine the precision (P) digit of the type flag:
+             */
+            int precision;
+
+            switch (type)
+            {
+            case miDOUBLE:
+                precision = 0; break;
+            case miSINGLE:
+                precision = 1; break;
+            case miINT32:
+                precision = 2; break;
+            case miINT16:
+                precision = 3; break;
+            case miUINT16:
+                precision = 4; break;
+            case miUINT8:
+                precision = 5; break;
+            default:
+                return false;
+            }
+
+            /*
+             * The machine (M) digit is 0 for little endian and 1 for
+             * big endian IEEE data:
+             */
+            const int one = 1;
+            const int machine =
+                *reinterpret_cast<const char*>(&one) == 1 ? 0 : 1;
+
+            /*
+             * Type flag, number of rows, number of columns (which we
+             * update as we write data samples), whether there is an
+             * imaginary part, and the length of the name including
+             * its terminating null:
+             */
+            const int header[5] =
+                { 1000 * machine + 10 * precision, rows, 0, 0,
+                  static_cast<int>(name.size() + 1) };
+
+            if (std::fwrite(header, sizeof(int), 5, fp) != 5)
+                return false;
+
+            return std::fwrite(name.c_str(), sizeof(char),
+                               name.size() + 1, fp) == name.size() + 1;
+        }
+
+    private:
+
+        /*
+         * Write numel samples to the current part, moving on to the next
+         * one when it fills up
+         */
+        size_t append(const void* data, size_t numel, bool update)
+        {
+            const unsigned char* bytes =
+                static_cast<const unsigned char*>(data);
+
+            if (_triggered)
+                return record(bytes, numel);
+
+            if (numel == 0)
+                return 0;
+
+            use_file();
+
+            size_t written = 0;
+
+            /*
+             * Without room for a column in a part, we would roll over
+             * forever:
+             */
+            while (_fp && _part_capacity > 0 && written < numel)
+            {
+                if (_rotation && _rotation->epoch() != _part_epoch)
+                {
+                    /*
+                     * A new rotation period has begun. Everything in
+                     * the current part was written before it started:
+                     */
+                    const long epoch = _rotation->epoch();
+
+                    if (_part_count > 0 &&
+                        !roll_over(_rotation->start_of(_part_epoch + 1)))
+                        break;
+
+                    _part_epoch = epoch;
+                    _part_start = _rotation->start_of(epoch);
+                }
+
+                if (_part_count == _part_capacity)
+                {
+                    if (!roll_over(_rotation ? std::time(NULL) : 0))
+                        break;
+                    else
+                        continue;
+                }
+
+                const size_t todo =
+                    std::min(numel - written,
+                             _part_capacity - _part_count);
+
+                size_t num;
+
+                const unsigned char* next =
+                    bytes + written * _sample_size;
+
+                if (_deflater)
+                    num = _deflater->write(_fp, next,
+                                           todo * _sample_size) ? todo : 0;
+                else if (_pool)
+                    num = buffer(next, todo);
+                else
+                    num = std::fwrite(next, _sample_size, todo, _fp);
+
+                _count      += num;
+                _part_count += num;
+                written     += num;
+
+                /*
+                 * The sizes of a compressed part are only filled in
+                 * when it is finished:
+                 */
+                if (num != todo)
+                    break;
+
+                if (!_deflater)
+                {
+                    if (!update)
+                        _stale = true;
+                    else if (!update_counters())
+                        break;
+                }
+
+                if (_index_stride && _part_count > _index_next)
+                    add_index_entries();
+
+                /*
+                 * Get the next part ready well before we need it:
+                 */
+                if (!_next_pending &&
+                    _part_count >= _part_capacity / 2)
+                {
+                    pre_create();
+                }
+            }
+
+            if (_time && _time->count() < _count / _rows)
+                add_timestamps(update);
+
+            if (_summarizer)
+                _summarizer->add(data, written);
+
+            return written;
+        }
+
+        /*
+         * Keep the last samples in the ring (in Triggered mode), adding
+         * them to the capture too if a trigger has fired. There is no
+         * I/O here until a capture is complete
+         */
+        size_t record(const unsigned char* bytes, size_t numel)
+        {
+            /*
+             * A type MatLab has no class for can't be saved:
+             */
+            if (_sample_size == 0)
+                return 0;
+
+            if (_capturing)
+            {
+                const size_t todo = std::min(numel, _post_left);
+
+                _capture.insert(_capture.end(), bytes,
+                                bytes + todo * _sample_size);
+
+                _post_left -= todo;
+                if (_post_left == 0)
+                    dump();
+            }
+
+            const size_t capacity = _ring.size() / std::max<size_t>(
+                                        _sample_size, 1);
+            if (capacity > 0)
+            {
+                /*
+                 * Only the last capacity samples can end up in the
+                 * ring:
+                 */
+                size_t i = numel > capacity ? numel - capacity : 0;
+
+                while (i < numel)
+                {
+                    const size_t todo =
+                        std::min(numel - i, capacity - _ring_next);
+
+                    std::memcpy(&_ring[_ring_next * _sample_size],
+                                bytes + i * _sample_size,
+                                todo * _sample_size);
+
+                    _ring_next = (_ring_next + todo) % capacity;
+                    i += todo;
+                }
+
+                _ring_count = std::min(_ring_count + numel, capacity);
+            }
+
+            _count += numel;
+            return numel;
+        }
+
+        /*
+         * Write what we captured after the last trigger to a file of
+         * its own, in the background
+         */
+        void dump()
+        {
+            std::shared_ptr<std::vector<unsigned char>> data =
+                std::make_shared<std::vector<unsigned char>>();
+            data->swap(_capture);
+
+            char dir[32];
+            std::snprintf(dir, sizeof(dir), "trigger%03d",
+                          _capture_index);
+
+            var_settings settings = _settings;
+            settings.dir       = _path + separator() + dir;
+            settings.files     = NULL;
+            settings.pool      = NULL;
+            settings.rotation  = NULL;
+            settings.triggered = false;
+            settings.worker    = NULL;
+
+            const std::string name    = _name;
+            const int         options = _options & (Compressed | Indexed);
+            const int         type    = _type;
+            const int         rows    = _rows;
+            const size_t      numel   = data->size() / _sample_size;
+
+            run_in_background([=] {
+                make_dir(settings.dir);
+
+                variable_base variable(settings, name, options, type,
+                                       rows);
+                variable.write(data->data(), numel);
+            });
+
+            _capturing = false;
+        }
+
+        /*
+         * Copy numel samples into our slab, leasing one if need be.
+         * Writes too big for a slab (or made when the pool has none to
+         * spare) go straight to the file
+         */
+        size_t buffer(const unsigned char* data, size_t numel)
+        {
+            const size_t bytes = numel * _sample_size;
+
+            if (!_slab)
+                _slab = _pool->lease(this);
+
+            if (_slab_used + bytes > _pool->slab_size() && !spill())
+                return 0;
+
+            if (!_slab || bytes > _pool->slab_size())
+                return std::fwrite(data, _sample_size, numel, _fp);
+
+            std::memcpy(_slab + _slab_used, data, bytes);
+            _slab_used += bytes;
+
+            return numel;
+        }
+
+        /*
+         * Write out the samples buffered in our slab
+         */
+        bool spill()
+        {
+            const size_t bytes = _slab_used;
+            _slab_used = 0;
+
+            const size_t written = bytes == 0 || !_fp ? 0 :
+                std::fwrite(_slab, 1, bytes, _fp);
+
+            if (written == bytes)
+                return true;
+
+            /*
+             * As with a short write, samples that didn't make it to
+             * the file aren't counted. The header is then out of date
+             * until a flush manages to update it. Nothing else is
+             * rolled back: the time column and summaries have already
+             * taken in the lost samples, so from here on they're ahead
+             * of the samples in the file, and a reducer's outputs that
+             * were lost stay lost:
+             */
+            const size_t lost =
+                bytes / _sample_size - written / _sample_size;
+
+            _count      -= lost;
+            _part_count -= lost;
+            _stale       = true;
+
+            return false;
+        }
+
+        void reclaim() override
+        {
+            use_file();
+            spill();
+
+            _pool->release(this, _slab);
+            _slab = NULL;
+        }
+
+        void close_file() override
+        {
+            _file_pos = std::ftell(_fp);
+
+            std::fclose(_fp);
+            _fp      = NULL;
+            _evicted = true;
+        }
+
+        /*
+         * Whether we have a file to write to, even if it hasn't been
+         * created yet or the file cache has closed it for now
+         */
+        bool has_file() const
+        {
+            return _fp || _evicted || _unopened;
+        }
+
+        /*
+         * Make sure our file is open, creating it if this is the first
+         * write or reopening it where we left off if the file cache
+         * closed it, and mark it as just used
+         */
+        bool use_file()
+        {
+            if (_unopened)
+            {
+                _unopened = false;
+                create_file();
+            }
+            else if (_evicted)
+            {
+                _evicted = false;
+                _fp = std::fopen(part_file(_part_index).c_str(), "r+b");
+
+                if (_fp && _pool)
+                    std::setvbuf(_fp, NULL, _IONBF, 0);
+
+                if (_fp && std::fseek(_fp, _file_pos, SEEK_SET))
+                {
+                    std::fclose(_fp);
+                    _fp = NULL;
+                }
+            }
+
+            if (_fp && _files)
+                _files->touch(this);
+
+            return _fp != NULL;
+        }
+
+        /*
+         * Create our first part
+         */
+        void create_file()
+        {
+            _fp = open_part(part_file(_part_index), _name, _type,
+                            _rows, _format, _compressed, _pool == NULL);
+
+            file_created();
+        }
+
+        /*
+         * Get ready to write to the first part, now that it exists
+         */
+        void file_created()
+        {
+            const bool ok = _fp || _evicted;
+
+            if (ok && _compressed)
+                _deflater.reset(new part_deflater(_restart_interval,
+                                                  _data_offset));
+
+            _part_start = std::time(NULL);
+
+            if (_rotation)
+            {
+                _part_epoch = _rotation->epoch();
+                if (ok)
+                    pre_create();
+            }
+        }
+
+        /*
+         * Bytes preceding the matrix element within its miCOMPRESSED
+         * element, if any
+         */
+        static long prefix_size(int options)
+        {
+            return (options & Compressed) ? COMPRESSED_PREFIX_SIZE : 0;
+        }
+
+        /*
+         * Number of bytes in the matrix element of an empty variable
+         */
+        static size_t meta_data_size(const std::string& name)
+        {
+            size_t bytes = ARRAY_FLAGS_SIZE    +
+                           DIM_ARRAY_SIZE      +
+                           ARRAY_NAME_TAG_SIZE +
+                           name.size()         +
+                           RE_TAG_SIZE;
+
+            if (name.size() % 8)
+                bytes +=  8-(name.size() % 8);
+
+            return bytes;
+        }
+
+        static FILE* open_part(const std::string& file,
+                               const std::string& name, int type,
+                               int rows, format_t format, bool compressed,
+                               bool buffered)
+        {
+            /*
+             * We need to read back the matrix header of a compressed
+             * part to checksum it:
+             */
+            FILE* fp = std::fopen(file.c_str(),
+                                  compressed ? "w+b" : "wb");
+
+            if (fp && !start_part(fp, name, type, rows, format,
+                                  compressed, buffered, NULL))
+            {
+                std::fclose(fp);
+                std::remove(file.c_str());
+                fp = NULL;
+            }
+
+            return fp;
+        }
+
+        /*
+         * Write the headers of a new part
+         *
+         * @param[in] created The creation time to put in the header,
+         *                    or NULL for now
+         */
+        static bool start_part(FILE* fp, const std::string& name,
+                               int type, int rows, format_t format,
+                               bool compressed, bool buffered,
+                               const char* created)
+        {
+            /*
+             * Variables which buffer in a pooled slab don't need a
+             * stdio buffer as well:
+             */
+            if (!buffered)
+                std::setvbuf(fp, NULL, _IONBF, 0);
+
+            return format == Level4 ?
+                write_level4_header(fp, name, type, rows) :
+                write_header(fp, name, created) &&
+                (!compressed || write_compressed_prefix(fp, name)) &&
+                write_meta_data(fp, name, type, rows);
+        }
+
+        std::string part_file(int index) const
+        {
+            std::string file = _path + separator() + _name;
+
+            if (index > 1)
+            {
+                char suffix[16];
+                std::snprintf(suffix, sizeof(suffix), "_part%03d",
+                              index);
+                file += suffix;
+            }
+
+            return file + ".mat";
+        }
+
+        void pre_create()
+        {
+            /*
+             * A part opened ahead of time would hold a descriptor the
+             * file cache doesn't know about, so with a cache we open
+             * the next part when we need it (see roll_over())
+             */
+            if (_files)
+                return;
+
+            std::shared_ptr<std::promise<FILE*>> promise =
+                std::make_shared<std::promise<FILE*>>();
+
+            const std::string file       = part_file(_part_index + 1);
+            const std::string name       = _name;
+            const int         type       = _type;
+            const int         rows       = _rows;
+            const format_t    format     = _format;
+            const bool        compressed = _compressed;
+            const bool        buffered   = _pool == NULL;
+
+            _next = promise->get_future().share();
+            _next_pending = true;
+
+            run_in_background([=] {
+                promise->set_value(
+                    open_part(file, name, type, rows, format,
+                              compressed, buffered));
+            });
+        }
+
+        /*
+         * Close the current part (it is already a complete MAT file),
+         * and continue writing to the next one
+         *
+         * @param[in] end The wall-clock time at which the current part
+         *                ends, if we are rotating
+         */
+        bool roll_over(std::time_t end)
+        {
+            retire(true, end);
+
+            FILE* next;
+
+            if (_files)
+            {
+                next = open_part(part_file(_part_index + 1), _name, _type,
+                                 _rows, _format, _compressed,
+                                 _pool == NULL);
+            }
+            else
+            {
+                if (!_next_pending)
+                    pre_create();
+
+                next = _next.get();
+                _next_pending = false;
+            }
+
+            _fp = next;
+            use_file();
+
+            _part_count = 0;
+            _part_first = _count;
+            _part_index++;
+            _part_start = end;
+
+            if (_fp && _compressed)
+                _deflater.reset(new part_deflater(
+                    _restart_interval, _data_offset));
+
+            _index_next    = 0;
+            _index_started = false;
+
+            /*
+             * When rotating on a schedule we can't tell how soon the
+             * next part is needed, so have it ready straight away:
+             */
+            if (_fp && _rotation)
+                pre_create();
+
+            return _fp != NULL;
+        }
+
+        /*
+         * Close the current part in the background, optionally adding
+         * it to the manifest. If we are rotating, it is also added to
+         * the rotation index
+         */
+        void retire(bool add_to_manifest, std::time_t end)
+        {
+            if (!use_file())
+            {
+                /*
+                 * Our file is gone, so the samples in our slab are lost
+                 * (see spill()), but the slab must go back to the pool:
+                 */
+                if (_slab)
+                    reclaim();
+
+                return;
+            }
+
+            std::vector<std::uint64_t> restarts;
+
+            if (_deflater)
+            {
+                /*
+                 * This has to happen before we move on, because the
+                 * deflater belongs to the current part:
+                 */
+                finish_compressed();
+
+                restarts = _deflater->restarts();
+                _deflater.reset();
+            }
+
+            if (!_index_entries.empty())
+                save_index();
+
+            flush();
+
+            if (_slab)
+                reclaim();
+
+            FILE* fp = _fp; _fp = NULL;
+
+            /*
+             * Parts closed in the background would briefly hold
+             * descriptors the file cache doesn't count:
+             */
+            if (_files)
+            {
+                _files->remove(this);
+
+                std::fclose(fp);
+                fp = NULL;
+            }
+
+            const std::string manifest =
+                _path + separator() + _name + ".manifest";
+            const std::string file  = part_file(_part_index);
+            const size_t      first = _part_first;
+            const size_t      count = _part_count;
+            const char*       mode  = _part_index == 1 ? "w" : "a";
+
+            const rotation_timer* rotation = _rotation;
+            const std::time_t     start    = _part_start;
+
+            run_in_background([=] {
+                if (fp)
+                    std::fclose(fp);
+
+                if (!restarts.empty())
+                {
+                    const std::string rst =
+                        file.substr(0, file.size() - 4) + ".rst";
+
+                    FILE* out = std::fopen(rst.c_str(), "wb");
+                    if (out)
+                    {
+                        std::fwrite(restarts.data(),
+                                    sizeof(std::uint64_t),
+                                    restarts.size(), out);
+                        std::fclose(out);
+                    }
+                }
+
+                if (rotation)
+                    rotation->add_to_index(start, end, file);
+
+                if (!add_to_manifest)
+                    return;
+
+                FILE* out = std::fopen(manifest.c_str(), mode);
+                if (out)
+                {
+                    std::fprintf(out, "%s %zu %zu\n",
+                                 file.c_str(), first, count);
+                    std::fclose(out);
+                }
+            });
+        }
+
+        /*
+         * Stamp the columns we just wrote (one per sample unless we have
+         * more than one row), unless another variable sharing our time
+         * column already has
+         */
+        void add_timestamps(bool update)
+        {
+            double stamps[64];
+            std::fill(stamps, stamps + 64, _clock->now());
+
+            const size_t columns = _count / _rows;
+
+            while (_time->count() < columns)
+            {
+                const size_t todo =
+                    std::min<size_t>(columns - _time->count(), 64);
+
+                if (_time->write(stamps, todo, update) != todo)
+                    break;
+            }
+        }
+
+        /*
+         * Index every stride'th sample we just wrote
+         */
+        void add_index_entries()
+        {
+            const double now = _clock->now();
+
+            for ( ; _index_next < _part_count;
+                  _index_next += _index_stride)
+            {
+                const index_entry entry =
+                    { _index_next,
+                      _data_offset + _index_next * _sample_size, now };
+
+                _index_entries.push_back(entry);
+            }
+
+            /*
+             * Hand the index over in batches so that appending to it
+             * costs next to nothing here:
+             */
+            if (_index_entries.size() >= 64)
+                save_index();
+        }
+
+        void save_index()
+        {
+            const std::string part = part_file(_part_index);
+            const std::string file =
+                part.substr(0, part.size() - 4) + ".idx";
+
+            const std::vector<index_entry> entries = _index_entries;
+
+            const char* mode = _index_started ? "ab" : "wb";
+
+            run_in_background([=] {
+                FILE* out = std::fopen(file.c_str(), mode);
+                if (out)
+                {
+                    std::fwrite(entries.data(), sizeof(index_entry),
+                                entries.size(), out);
+                    std::fclose(out);
+                }
+            });
+
+            _index_entries.clear();
+            _index_started = true;
+        }
+
+        /*
+         * Finish the current compressed part, so that it can be loaded
+         */
+        bool finish_compressed()
+        {
+            const size_t rem = (_part_count * _sample_size) % 8;
+
+            return _deflater->finish(_fp, rem ? 8 - rem : 0)
+                && update_counters()
+                && _deflater->write_trailer(
+                       _fp, 128, 128 + COMPRESSED_PREFIX_SIZE,
+                       8 + _mat_tag_size);
+        }
+
+        void run_in_background(const std::function<void()>& task)
+        {
+            if (_worker)
+                _worker->post(task);
+            else
+                task();
+        }
+
+        bool update_counters()
+        {
+            _stale = false;
+
+            if (!spill())
+                return false;
+
+            if (_format == Level4)
+                return update_level4_counter();
+
+            long curr = std::ftell(_fp);
+            if (curr == -1)
+                return false;
+
+            /*
+             * All size fields are 32 bits wide, which _part_capacity
+             * guarantees we never overflow:
+             */
+            const size_t data_bytes = _part_count * _sample_size;
+
+            const size_t rem = data_bytes % 8;
+            const size_t pad = rem ? 8 - rem : 0;
+
+            std::uint32_t bytes = static_cast<std::uint32_t>(
+                _mat_tag_size + data_bytes + pad);
+
+            /*
+             * Seeking flushes the data before any of the header. The
+             * sample count is then published twice, in the dimensions
+             * and as the size of the real part, so that MatTail can
+             * tell when it reads the header part way through an update
+             */
+            if (std::fseek(_fp,_mat_tag_offset,SEEK_SET))
+                return false;
+            if (std::fwrite(&bytes, sizeof(bytes), 1, _fp)
+                != 1)
+                return false;
+
+            const std::uint32_t count =
+                static_cast<std::uint32_t>(_part_count / _rows);
+
+            if (std::fseek(_fp,_dim_tag_offset,SEEK_SET))
+                return false;
+            if (std::fwrite(&count, sizeof(count), 1, _fp)
+                != 1)
+                return false;
+
+            bytes = static_cast<std::uint32_t>(data_bytes);
+
+            if (std::fseek(_fp,_re_tag_offset, SEEK_SET))
+                return false;
+            if (std::fwrite(&bytes, sizeof(bytes), 1, _fp)
+                != 1)
+                return false;
+
+            if (std::fseek(_fp, curr, SEEK_SET))
+                return false;
+
+            if (pad && !_deflater)
+            {
+                /*
+                 * Add padding to make sure the data aligns on
+                 * an 8-byte boundary in case this is the last
+                 * write:
+                 */
+                const char zeros[8] = {0};
+                if (std::fwrite(&zeros,sizeof(char),pad,_fp)
+                    != pad)
+                    return false;
+                if ( std::fseek(  _fp, curr, SEEK_SET ) != 0 )
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool update_level4_counter()
+        {
+            long curr = std::ftell(_fp);
+            if (curr == -1)
+                return false;
+
+            const std::int32_t cols =
+                static_cast<std::int32_t>(_part_count / _rows);
+
+            if (std::fseek(_fp, LEVEL4_COLS_OFFSET, SEEK_SET))
+                return false;
+            if (std::fwrite(&cols, sizeof(cols), 1, _fp) != 1)
+                return false;
+
+            return std::fseek(_fp, curr, SEEK_SET) == 0;
+        }
+
+        std::vector<unsigned char>       _capture;
+        int                              _capture_index;
+        bool                             _capturing;
+        const sample_clock*              _clock;
+        const bool                       _compressed;
+        size_t                           _count;
+        size_t                           _data_offset;
+        std::unique_ptr<part_deflater>   _deflater;
+        const int                        _dim_tag_offset;
+        bool                             _evicted;
+        long                             _file_pos;
+        file_cache*                      _files;
+        const format_t                   _format;
+        FILE*                            _fp;
+        std::vector<index_entry>         _index_entries;
+        size_t                           _index_next;
+        bool                             _index_started;
+        size_t                           _index_stride;
+        const int                        _mat_tag_offset;
+        size_t                           _mat_tag_size;
+        std::string                      _name;
+        std::shared_future<FILE*>        _next;
+        bool                             _next_pending;
+        const int                        _options;
+        size_t                           _part_capacity;
+        size_t                           _part_count;
+        long                             _part_epoch;
+        size_t                           _part_first;
+        int                              _part_index;
+        std::time_t                      _part_start;
+        std::string                      _path;
+        buffer_pool*                     _pool;
+        size_t                           _post_left;
+        const size_t                     _post_trigger;
+        long                             _re_tag_offset;
+        std::vector<unsigned char>       _reduced;
+        std::unique_ptr<reducer_base>    _reducer;
+        const size_t                     _restart_interval;
+        std::vector<unsigned char>       _ring;
+        size_t                           _ring_count;
+        size_t                           _ring_next;
+        const rotation_timer*            _rotation;
+        const int                        _rows;
+        const size_t                     _sample_size;
+        const var_settings               _settings;
+        unsigned char*                   _slab;
+        size_t                           _slab_used;
+        bool                             _stale;
+        std::unique_ptr<summarizer_base> _summarizer;
+        std::shared_ptr<variable_base>   _time;
+        const bool                       _triggered;
+        const int                        _type;
+        bool                             _unopened;
+        background_worker*               _worker;
+    };
+
+    /*
+     * Keeps min/max/mean summaries of a variable of type T, at block
+     * sizes which double from one level to the next. Each level is a
+     * variable called <name>_summary<block size> with a column of
+     * (min, max, mean) per block. Level 0 is summarized from the
+     * samples, and each level above from pairs of columns of the one
+     * below, so the samples are only looked at once
+     */
+    template <class T>
+    class summarizer : public summarizer_base
+    {
+    public:
+
+        summarizer(const var_settings& settings, const std::string& name)
+            : _levels()
+        {
+            const std::vector<std::pair<std::string, size_t> > named =
+                levels(settings, name);
+
+            for (size_t i = 0; i < named.size(); i++)
+            {
+                const column empty = { 0, 0, 0, 0 };
+
+                level added;
+                added.block   = named[i].second;
+                added.current = empty;
+                added.filled  = 0;
+                added.var.reset(new variable_base(
+                    settings, named[i].first, 0, miDOUBLE, 3));
+
+                _levels.push_back(std::move(added));
+            }
+        }
+
+        void add(const void* data, size_t numel) override
+        {
+            if (_levels.empty())
+                return;
+
+            const T* in = static_cast<const T*>(data);
+            level&   first = _levels[0];
+
+            while (numel > 0)
+            {
+                const size_t todo =
+                    std::min(numel, first.block - first.filled);
+
+                /*
+                 * The loop over a block is simple enough for the
+                 * compiler to vectorize:
+                 */
+                T      lo  = in[0], hi = in[0];
+                double sum = 0;
+
+                for (size_t i = 0; i < todo; i++)
+                {
+                    lo   = std::min(lo, in[i]);
+                    hi   = std::max(hi, in[i]);
+                    sum += in[i];
+                }
+
+                const column summary = { double(lo), double(hi), sum,
+                                         todo };
+                merge(first, summary);
+
+                first.filled += todo;
+                in           += todo;
+                numel        -= todo;
+
+                if (first.filled == first.block)
+                    end_block(0);
+            }
+        }
+
+        void finish() override
+        {
+            for (size_t i = 0; i < _levels.size(); i++)
+            {
+                if (_levels[i].filled > 0)
+                    end_block(i);
+            }
+        }
+
+    private:
+
+        /*
+         * A summary of some number of samples
+         */
+        struct column
+        {
+            double min;
+            double max;
+            double sum;
+            size_t count;
+        };
+
+        struct level
+        {
+            size_t                         block;
+            column                         current;
+            size_t                         filled;
+            std::unique_ptr<variable_base> var;
+        };
+
+        static void merge(level& into, const column& summary)
+        {
+            if (into.filled == 0)
+            {
+                into.current = summary;
+                return;
+            }
+
+            into.current.min    = std::min(into.current.min, summary.min);
+            into.current.max    = std::max(into.current.max, summary.max);
+            into.current.sum   += summary.sum;
+            into.current.count += summary.count;
+        }
+
+        /*
+         * Write the current column of a level, and pass it up to the
+         * next level
+         */
+        void end_block(size_t index)
+        {
+            level& done = _levels[index];
+
+            const double out[] = { done.current.min, done.current.max,
+                                   done.current.sum / done.current.count };
+            done.var->write(out, 3);
+
+            if (index + 1 < _levels.size())
+            {
+                level& next = _levels[index + 1];
+
+                merge(next, done.current);
+                next.filled += done.filled;
+
+                if (next.filled == next.block)
+                    end_block(index + 1);
+            }
+
+            done.filled = 0;
+        }
+
+        std::vector<level> _levels;
+    };
+
+    /*
+     * Represents an output variable of type T, which can be an
+     * int, float, etc.
+     */
+    template <class T>
+    class Variable : public variable_base
+    {
+    public:
+
+        Variable(const var_settings& settings, const std::string& name,
+                 int options)
+            : variable_base(settings, name, options, mi_type<T>())
+        {
+            if ((options & Summarized) && !settings.triggered)
+                set_summarizer(new summarizer<T>(settings, name));
+        }
+
+        Variable(const var_settings& settings, const std::string& name,
+                 int options, reduction_t reduction, size_t factor)
+            : variable_base(settings, name, options, mi_type<T>(),
+                            reduction == Envelope ? 2 : 1)
+        {
+            set_reducer(new reducer<T>(reduction, factor));
+
+            /*
+             * An envelope's rows aren't samples of the same thing:
+             */
+            if ((options & Summarized) && reduction != Envelope &&
+                !settings.triggered)
+                set_summarizer(new summarizer<T>(settings, name));
+        }
+
+        bool write(const T& element)
+        {
+            return write(&element, 1) == 1;
+        }
+
+        size_t write(const T* data, size_t numel)
+        {
+            return variable_base::write(data, numel);
+        }
+    };
+
+    /*
+     * The time columns of timestamped variables. A column is shared by
+     * every variable created with the same time column name, and is
+     * closed along with the last of them
+     */
+    class time_columns
+    {
+    public:
+
+        time_columns()
+            : _columns()
+        {
+        }
+
+        /*
+         * Get the name of the time column of a variable
+         */
+        static std::string column_name(const var_settings& settings,
+                                       const std::string& name)
+        {
+            return settings.time_column.empty() ?
+                name + "_time" : settings.time_column;
+        }
+
+        std::shared_ptr<variable_base> get(const var_settings& settings,
+                                           const std::string& name)
+        {
+            for (size_t i = 0; i < _columns.size(); i++)
+            {
+                if (_columns[i].first != name)
+                    continue;
+
+                std::shared_ptr<variable_base> column =
+                    _columns[i].second.lock();
+                if (column)
+                    return column;
+            }
+
+            std::shared_ptr<variable_base> column(
+                new variable_base(settings, name, 0, miDOUBLE));
+
+            _columns.push_back(std::make_pair(name, column));
+            return column;
+        }
+
+    private:
+
+        std::vector<std::pair<std::string,
+                              std::weak_ptr<variable_base> > > _columns;
+    };
+
+    /*
+     * Maps variable names to IDs. This is an open addressing hash
+     * table with linear probing, which is looked up by string_view so
+     * that a name never has to be copied into a std::string to find
+     * it. IDs are handed out in order, starting from 0
+     */
+    class name_table
+    {
+    public:
+
+        name_table()
+            : _hashes(), _names(), _slots(16, -1)
+        {
+        }
+
+        /*
+         * Get the ID of a name, given its hash, or -1 if it isn't in
+         * the table
+         */
+        int find(std::string_view name, std::uint64_t hash) const
+        {
+            const size_t mask = _slots.size() - 1;
+
+            for (size_t i = hash & mask; _slots[i] != -1;
+                 i = (i + 1) & mask)
+            {
+                const int id = _slots[i];
+
+                if (_hashes[id] == hash && _names[id] == name)
+                    return id;
+            }
+
+            return -1;
+        }
+
+        /*
+         * Add a name which isn't in the table yet, and get its ID
+         */
+        int insert(const std::string& name)
+        {
+            const int id = static_cast<int>(_names.size());
+
+            _hashes.push_back(name_hash(name));
+            _names.push_back(name);
+
+            /*
+             * Keep the table at most half full:
+             */
+            if (2 * _names.size() > _slots.size())
+            {
+                _slots.assign(2 * _slots.size(), -1);
+
+                for (size_t i = 0; i < _names.size(); i++)
+                    place(static_cast<int>(i));
+            }
+            else
+                place(id);
+
+            return id;
+        }
+
+    private:
+
+        void place(int id)
+        {
+            const size_t mask = _slots.size() - 1;
+
+            size_t i = _hashes[id] & mask;
+            while (_slots[i] != -1)
+                i = (i + 1) & mask;
+
+            _slots[i] = id;
+        }
+
+        std::vector<std::uint64_t> _hashes;
+        std::vector<std::string>   _names;
+        std::vector<int>           _slots;
+    };
+
+    /*
+     * Holds the variables of a MatFile. They are constructed in place,
+     * in the order they are created, in blocks of slots allocated
+     * together, so that sweeping over them (e.g. in flush()) walks
+     * through memory in order rather than visiting allocations
+     * scattered over the heap. Variable<T> adds nothing to
+     * variable_base, so every variable fits the same slot
+     */
+    class variable_arena
+    {
+    public:
+
+        variable_arena()
+            : _blocks(), _used(BLOCK_SLOTS), _variables()
+        {
+        }
+
+        variable_arena(const variable_arena& copy)            = delete;
+        variable_arena& operator=(const variable_arena& rhs) = delete;
+
+        ~variable_arena()
+        {
+            clear();
+        }
+
+        /*
+         * Construct a variable in the next free slot
+         */
+        template <class V, class... Args>
+        V* emplace(Args&&... args)
+        {
+            static_assert(sizeof(V) <= sizeof(slot) &&
+                          alignof(V) <= alignof(slot),
+                          "Variables must fit a slot");
+
+            if (_used == BLOCK_SLOTS)
+            {
+                _blocks.emplace_back(new slot[BLOCK_SLOTS]);
+                _used = 0;
+            }
+
+            V* variable = new (&_blocks.back()[_used])
+                V(std::forward<Args>(args)...);
+
+            _used++;
+            _variables.push_back(variable);
+
+            return variable;
+        }
+
+        /*
+         * Destroy every variable, in the order they were created
+         */
+        void clear()
+        {
+            for (size_t i = 0; i < _variables.size(); i++)
+                _variables[i]->~variable_base();
+
+            _variables.clear();
+            _blocks.clear();
+            _used = BLOCK_SLOTS;
+        }
+
+        size_t size() const
+        {
+            return _variables.size();
+        }
+
+        variable_base* operator[](size_t index) const
+        {
+            return _variables[index];
+        }
+
+    private:
+
+        static const size_t BLOCK_SLOTS = 64;
+
+        struct alignas(variable_base) slot
+        {
+            unsigned char bytes[sizeof(variable_base)];
+        };
+
+        std::vector<std::unique_ptr<slot[]>> _blocks;
+        size_t                               _used;
+        std::vector<variable_base*>          _variables;
+    };
+
+public:
+
+    /**
+     * Running mode of this instance
+     */
+    typedef enum
+    {
+        RealTime, /**< Set up for real-time data collection */
+        Triggered /**< Only keep the most recent samples of each
+                       variable in memory, and save them when
+                       trigger() is called. Variables can't be
+                       Timestamped or Summarized in this mode */
+    } mode_t;
+
+    /**
+     * A variable name hashed at compile time, e.g.
+     *
+     *     static constexpr MatFile::Key voltage("voltage");
+     *     matfile.write(voltage, 3.3);
+     *
+     * Writing by Key costs about the same as writing by ID
+     */
+    struct Key
+    {
+        /**
+         * Constructor
+         *
+         * @param[in] name_ The variable name. This must outlive the
+         *                  key, as string literals do
+         */
+        constexpr explicit Key(std::string_view name_)
+            : hash(name_hash(name_)), name(name_)
+        {
+        }
+
+        std::uint64_t    hash; /**< The hash of the name */
+        std::string_view name; /**< The variable name */
+    };
+
+    class Frame;
+
+    /**
+     * A typed reference to a variable, obtained from create_handle().
+     * Writing through a handle goes straight to the variable, without
+     * looking it up or checking its type. A handle is only valid for
+     * as long as the MatFile that created it
+     *
+     * @tparam T The type of the variable
+     */
+    template <typename T>
+    class Handle
+    {
+        friend class Frame;
+        friend class MatFile;
+
+    public:
+
+        /**
+         * Constructor. Creates a handle that refers to no variable
+         */
+        Handle() : _var(NULL)
+        {
+        }
+
+        /**
+         * Get the flag indicating if this handle refers to a variable
+         *
+         * @return True if the handle was successfully created
+         */
+        bool is_valid() const
+        {
+            return _var != NULL;
+        }
+
+        /**
+         * Write the next data sample
+         *
+         * @param[in] value The value to write
+         *
+         * @return True on success
+         */
+        bool write(const T& value) const
+        {
+            return _var && _var->write(value);
+        }
+
+        /**
+         * Write the next several data samples
+         *
+         * @param[in] data  The values to write
+         * @param[in] numel The number of values
+         *
+         * @return The number of values written
+         */
+        size_t write(const T* data, size_t numel) const
+        {
+            return _var ? _var->write(data, numel) : 0;
+        }
+
+    private:
+
+        explicit Handle(Variable<T>* var) : _var(var)
+        {
+        }
+
+        Variable<T>* _var;
+    };
+
+    /**
+     * A set of samples for several variables, which are written all
+     * at once by commit(). Samples are added by handle, e.g.
+     *
+     *     MatFile::Frame frame;
+     *     frame.add(voltage, 3.3);
+     *     frame.add(current, 0.1);
+     *     frame.commit();
+     *
+     * Rather than updating a variable's header after every write, as
+     * MatFile::write() does, a commit updates it once, or not at all
+     * until MatFile::flush() is called. A frame can be reused after it
+     * is committed
+     */
+    class Frame
+    {
+    public:
+
+        /**
+         * Constructor
+         */
+        Frame()
+            : _data(), _entries()
+        {
+        }
+
+        /**
+         * Add a sample to the frame
+         *
+         * @param[in] handle The variable to write to
+         * @param[in] value  The value to write
+         */
+        template <typename T>
+        void add(const Handle<T>& handle, const T& value)
+        {
+            add(handle, &value, 1);
+        }
+
+        /**
+         * Add several samples to the frame
+         *
+         * @param[in] handle The variable to write to
+         * @param[in] data   The values to write
+         * @param[in] numel  The number of values
+         */
+        template <typename T>
+        void add(const Handle<T>& handle, const T* data, size_t numel)
+        {
+            const entry added = { handle._var, _data.size(), numel };
+            _entries.push_back(added);
+
+            const unsigned char* bytes =
+                reinterpret_cast<const unsigned char*>(data);
+            _data.insert(_data.end(), bytes, bytes + numel * sizeof(T));
+        }
+
+        /**
+         * Write every sample in the frame, then empty it
+         *
+         * @param[in] flush If true, update the header of each variable
+         *                  written to. Otherwise headers are updated by
+         *                  MatFile::flush(), or when files are closed;
+         *                  until then readers only see the samples
+         *                  written before
+         *
+         * @return True if every sample was written
+         */
+        bool commit(bool flush = true)
+        {
+            bool ok = true;
+
+            for (size_t i = 0; i < _entries.size(); i++)
+            {
+                const entry& e = _entries[i];
+
+                ok = e.var &&
+                    e.var->write(&_data[e.offset], e.numel, false) ==
+                        e.numel && ok;
+            }
+
+            for (size_t i = 0; flush && i < _entries.size(); i++)
+            {
+                if (_entries[i].var)
+                    ok = _entries[i].var->flush() && ok;
+            }
+
+            _data.clear();
+            _entries.clear();
+
+            return ok;
+        }
+
+    private:
+
+        struct entry
+        {
+            variable_base* var;
+            size_t         offset;
+            size_t         numel;
+        };
+
+        std::vector<unsigned char> _data;
+        std::vector<entry>         _entries;
+    };
+
+    /**
+     * A fixed set of variables, declared at compile time. Each field
+     * is a type that names the variable and its element type, e.g.
+     *
+     *     struct Voltage
+     *     {
+     *         typedef double type;
+     *         static const char* name() { return "voltage"; }
+     *     };
+     *
+     *     MatFile::Schema<Voltage, Current> telemetry(matfile);
+     *     telemetry.write<Voltage>(3.3);
+     *
+     * The variables are held in a std::tuple rather than registered
+     * with the MatFile, so writes are resolved at compile time, with
+     * no lookup, no type check and no virtual call. Each field is
+     * still a complete variable, though, and each write goes through
+     * the same write path as any other (part rollover, indexing, pool
+     * and file cache), not just a store into a buffer; the options
+     * and settings of the MatFile apply to fields as they do to
+     * variables from create(). Field names must be unique, and
+     * must not also be passed to create(). A Schema must not outlive
+     * the MatFile it was created with, which keeps track of its
+     * variables only so that MatFile::trigger() reaches them
+     *
+     * @tparam Fields The field types
+     */
+    template <typename... Fields>
+    class Schema
+    {
+    public:
+
+        /**
+         * Constructor. Creates a variable for every field
+         *
+         * @param[in] matfile The MatFile whose settings (directory,
+         *                    format, etc.) the variables use
+         * @param[in] options A combination of option_t flags, applied
+         *                    to every field
+         */
+        Schema(MatFile& matfile, int options = 0)
+            : _args(matfile._settings, options),
+              _fields(args_for<Fields>()...),
+              _is_ready(matfile.is_ready() &&
+                        matfile.options_allowed(options)),
+              _matfile(matfile)
+        {
+            (_matfile._grouped.push_back(
+                 &std::get<field<Fields> >(_fields)), ...);
+        }
+
+        Schema(const Schema& copy)            = delete;
+        Schema& operator=(const Schema& rhs) = delete;
+
+        ~Schema()
+        {
+            std::vector<variable_base*>& grouped = _matfile._grouped;
+
+            (grouped.erase(std::find(grouped.begin(), grouped.end(),
+                                     &std::get<field<Fields> >(_fields))),
+             ...);
+        }
+
+        /**
+         * Get the flag indicating if the variables were created
+         *
+         * @return True if the MatFile was ready, and the options are
+         *         allowed in its mode (see MatFile::mode_t)
+         */
+        bool is_ready() const
+        {
+            return _is_ready;
+        }
+
+        /**
+         * Write the next data sample of one field
+         *
+         * @tparam Field The field to write to
+         *
+         * @param[in] value The value to write
+         *
+         * @return True on success
+         */
+        template <typename Field>
+        bool write(const typename Field::type& value)
+        {
+            return std::get<field<Field> >(_fields).write(value);
+        }
+
+        /**
+         * Write the next data sample of every field
+         *
+         * @param[in] values The values to write, in field order
+         *
+         * @return True if every value was written
+         */
+        bool write(const typename Fields::type&... values)
+        {
+            bool ok = true;
+
+            ((ok = std::get<field<Fields> >(_fields).write(values) &&
+                   ok), ...);
+
+            return ok;
+        }
+
+    private:
+
+        /*
+         * What each field's variable is constructed from
+         */
+        struct field_args
+        {
+            field_args(const var_settings& settings_, int options_)
+                : options(options_), settings(settings_)
+            {
+            }
+
+            int                 options;
+            const var_settings& settings;
+        };
+
+        template <typename Field>
+        class field : public Variable<typename Field::type>
+        {
+        public:
+
+            field(const field_args& args)
+                : Variable<typename Field::type>(args.settings,
+                                                 Field::name(),
+                                                 args.options)
+            {
+            }
+        };
+
+        template <typename Field>
+        const field_args& args_for() const
+        {
+            return _args;
         }
 
-        size_t      _count;
-        const int   _dim_tag_offset;
-        FILE*       _fp;
-        const int   _mat_tag_offset;
-        size_t      _mat_tag_size;
-        std::string _name;
-        int          _re_tag_offset;
-    };
+        const field_args             _args;
+        std::tuple<field<Fields>...> _fields;
+        const bool                   _is_ready;
+        MatFile&                     _matfile;
+    };
+
+    /**
+     * Constructor
+     *
+     * @param[in] running_mode Mode to run in (see mode_t)
+     * @param[in] dir The output directory
+     * @param[in] format The MAT file format to write
+     */
+    MatFile(mode_t running_mode, const std::string& dir,
+            format_t format = Level5)
+        : _clock(),
+          _files(),
+          _grouped(),
+          _names(),
+          _pool(),
+          _reserved(),
+          _rotation(),
+          _running_mode(running_mode),
+          _time_columns(),
+          _trigger_count(0),
+          _variables(),
+          _worker()
+    {
+        struct stat info;
+        _is_ready =
+            !stat(dir.c_str(), &info);
+
+        _settings.clock            = &_clock;
+        _settings.dir              = dir;
+        _settings.files            = NULL;
+        _settings.format           = format;
+        _settings.index_stride     = 4096;
+        _settings.max_part_size    = 0x7FFFFFFF;
+        _settings.pool             = NULL;
+        _settings.post_trigger     = 1 << 16;
+        _settings.pre_trigger      = 1 << 16;
+        _settings.restart_interval = 1 << 20;
+        _settings.rotation         = NULL;
+        _settings.summary_block    = 1024;
+        _settings.summary_levels   = 8;
+        _settings.timestamps       = &_time_columns;
+        _settings.triggered        = running_mode == Triggered;
+        _settings.worker           = &_worker;
+    }
+
+    /**
+     * Destructor
+     */
+    ~MatFile()
+    {
+        _variables.clear();
+    }
+
+    /**
+     * Create a new output variable. This will create a new MAT file
+     * that contains data for this variable only. The file is created
+     * when the first sample is written, so a variable which is never
+     * written leaves no file behind
+     *
+     * @tparam T The type of this variable. This must be a basic C++
+     *           type (e.g. float), or anything typedef'd to one
+     *
+     * @param [in] name    The name of this variable. This is also
+     *                     what the MAT file will be called
+     * @param [in] options A combination of option_t flags
+     *
+     * @return A unique ID by which to reference the variable, or if
+     *         it already exists, its ID. Returns -1 if T has no MatLab
+     *         class, the options aren't allowed in our mode (see
+     *         mode_t), or the name clashes with a time column or
+     *         summary (see set_time_column(), set_summary_levels())
+     */
+    template <typename T>
+    int create(const std::string& name, int options = 0)
+    {
+        if (!_is_ready)
+            return -1;
+
+        const int id = _names.find(name, name_hash(name));
+        if (id >= 0)
+            return id;
+
+        if (!can_create(name, options, mi_type<T>()))
+            return -1;
+
+        _variables.emplace<Variable<T>>(_settings, name, options);
+        reserve(name, options);
+
+        return _names.insert(name);
+    }
+
+    /**
+     * Create a new output variable which reduces its samples as they
+     * are written, so that only the reduced samples reach the disk.
+     * Whatever is left of the last block of samples is reduced when
+     * the variable is closed
+     *
+     * @tparam T The type of this variable
+     *
+     * @param [in] name      The name of this variable
+     * @param [in] options   A combination of option_t flags
+     * @param [in] reduction How to reduce the samples
+     * @param [in] factor    The number of samples reduced at a time
+     *
+     * @return A unique ID by which to reference the variable, or if
+     *         it already exists, its ID. Returns -1 if T has no MatLab
+     *         class, the options aren't allowed in our mode (see
+     *         mode_t), or the name clashes with a time column or
+     *         summary (see set_time_column(), set_summary_levels())
+     */
+    template <typename T>
+    int create(const std::string& name, int options,
+               reduction_t reduction, size_t factor)
+    {
+        if (!_is_ready)
+            return -1;
 
-    typedef std::vector<variable_base*>
-        var_v;
-    typedef std::map<std::string , int>
-        str_int_map;
+        const int id = _names.find(name, name_hash(name));
+        if (id >= 0)
+            return id;
 
-public:
+        /*
+         * An envelope has no summaries (see Variable<T>):
+         */
+        const int named = reduction == Envelope ?
+            options & ~Summarized : options;
+
+        if (!can_create(name, named, mi_type<T>()))
+            return -1;
+
+        _variables.emplace<Variable<T>>(_settings, name, options,
+                                        reduction, factor);
+        reserve(name, named);
+
+        return _names.insert(name);
+    }
 
     /**
-     * Running mode of this instance
+     * Create a new output variable whose type is only known at runtime.
+     * Write to it with write(int, const void*, size_t)
+     *
+     * @param [in] name     The name of this variable
+     * @param [in] mx_class The array class of this variable, one of
+     *                      mxDOUBLE_CLASS to mxUINT64_CLASS
+     * @param [in] options  A combination of option_t flags
+     *
+     * @return A unique ID by which to reference the variable, or if
+     *         it already exists, its ID. Returns -1 if mx_class isn't
+     *         a numeric class, the options aren't allowed in our mode
+     *         (see mode_t), or the name clashes with a time column or
+     *         summary (see set_time_column(), set_summary_levels())
      */
-    typedef enum
+    int create(const std::string& name, int mx_class, int options = 0)
     {
-        RealTime /**< Set up for real-time data collection */
-    } mode_t;
+        if (!_is_ready || mx_class < 0 || mx_class > mxUINT64_CLASS ||
+            mx2mi[mx_class] == 0)
+            return -1;
+
+        const int id = _names.find(name, name_hash(name));
+        if (id >= 0)
+            return id;
+
+        if (!can_create(name, options, mx2mi[mx_class]))
+            return -1;
+
+        _variables.emplace<variable_base>(_settings, name, options,
+                                          mx2mi[mx_class]);
+        reserve(name, options);
+
+        return _names.insert(name);
+    }
 
     /**
-     * Constructor
+     * Create many output variables of the same type at once, as
+     * create() does, e.g. at startup. Unlike create(), their files are
+     * created straight away: on a pool of threads, relative to the
+     * output directory (which is then synced once), and with the
+     * creation time in their headers worked out just once
      *
-     * @param[in] running_mode Mode to run in. Currently only
-     *            RealTime is supported
-     * @param[in] dir The output directory
+     * @tparam T The type of these variables
+     *
+     * @param [in] names   The names of the variables
+     * @param [in] options A combination of option_t flags
+     *
+     * @return The ID of each variable, in the order of names, which is
+     *         the ID it already had if it exists. IDs are -1 if this
+     *         object isn't ready, if T has no MatLab class, if the
+     *         options aren't allowed in our mode (see mode_t), or if
+     *         the name clashes with a time column or summary (see
+     *         set_time_column(), set_summary_levels())
      */
-    MatFile(mode_t running_mode, const std::string& dir)
-        : _dir(dir),
-          _name2id(),
-          _running_mode(running_mode),
-          _variables()
+    template <typename T>
+    std::vector<int> create_many(const std::vector<std::string>& names,
+                                 int options = 0)
     {
-        struct stat info;
-        _is_ready =
-            !stat(dir.c_str(), &info);
+        std::vector<int> ids(names.size(), -1);
+
+        if (!_is_ready)
+            return ids;
+
+        std::vector<variable_base*> created;
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            ids[i] = _names.find(names[i], name_hash(names[i]));
+            if (ids[i] >= 0 ||
+                !can_create(names[i], options, mi_type<T>()))
+                continue;
+
+            variable_base* variable =
+                _variables.emplace<Variable<T>>(_settings, names[i],
+                                                options);
+            reserve(names[i], options);
+            ids[i] = _names.insert(names[i]);
+
+            if (variable->needs_file())
+                created.push_back(variable);
+        }
+
+        create_files(created);
+        return ids;
     }
 
     /**
-     * Destructor
+     * Create a new output variable, as create() does, and get a typed
+     * handle to write to it with
+     *
+     * @tparam T The type of this variable
+     *
+     * @param [in] name    The name of this variable
+     * @param [in] options A combination of option_t flags
+     *
+     * @return A handle to the variable, which is not valid (see
+     *         Handle::is_valid()) if creation failed or a variable of
+     *         another type, or of a runtime type, already has this name
      */
-    ~MatFile()
+    template <typename T>
+    Handle<T> create_handle(const std::string& name, int options = 0)
+    {
+        const int id = create<T>(name, options);
+        if (id < 0)
+            return Handle<T>();
+
+        return Handle<T>(dynamic_cast<Variable<T>*>(_variables[id]));
+    }
+
+    /**
+     * Update the headers of every variable that Frame::commit() has
+     * left out of date
+     *
+     * @return True on success
+     */
+    bool flush()
     {
+        bool ok = _is_ready;
+
         for (size_t i = 0; i < _variables.size(); i++)
-            delete _variables[i];
+            ok = _variables[i]->flush() && ok;
+
+        return ok;
     }
 
     /**
-     * Create a new output variable. This will create a new MAT file
-     * that contains data for this variable only
+     * Set the maximum size of each file written for a variable. Once
+     * a variable would grow past this, it rolls over into a new file
+     * (see Variable). This only applies to variables created after it
+     * is called. A variable whose header and first column don't fit
+     * in this many bytes puts one column in each file
      *
-     * @tparam T The type of this variable. This must be a basic C++
-     *           type (e.g. float), or anything typedef'd to one
+     * @param[in] bytes The maximum file size. This cannot exceed the
+     *                  2 GB limit of a Level 5 MAT file, which is the
+     *                  default, or be less than MIN_PART_SIZE
      *
-     * @param [in] name The name of this variable. This is also what
-     *                  the MAT file will be called
+     * @return True on success
+     */
+    bool set_max_part_size(size_t bytes)
+    {
+        if (bytes < MIN_PART_SIZE)
+            return false;
+
+        _settings.max_part_size = std::min<size_t>(bytes, 0x7FFFFFFF);
+        return true;
+    }
+
+    /**
+     * Set how much data a compressed variable deflates between restart
+     * points. Smaller intervals allow compressed data to be inflated
+     * in parallel in smaller pieces, at some cost in compression. This
+     * only applies to variables created after it is called
      *
-     * @return A unique ID by which to reference the variable, or if
-     *         it already exists, its ID
+     * @param[in] bytes The restart interval. The default is 1 MiB
      */
-    template <typename T>
-    int create(const std::string& name)
+    void set_restart_interval(size_t bytes)
     {
-        if (!_is_ready)
-            return -1;
+        _settings.restart_interval = bytes;
+    }
+
+    /**
+     * Set how often indexed variables (see Indexed) record an entry in
+     * their seek index. This only applies to variables created after
+     * it is called
+     *
+     * @param[in] samples The number of samples between entries. The
+     *                    default is 4096
+     */
+    void set_index_stride(size_t samples)
+    {
+        _settings.index_stride = samples;
+    }
+
+    /**
+     * Set the resolutions at which summarized variables (see Summarized)
+     * keep summaries. Level 0 summarizes blocks of first_block samples,
+     * and the block size doubles at each level after that. A viewer
+     * can draw any stretch of a variable from the level with as many
+     * columns as it has pixels. Each level is a variable called
+     * <name>_summary<block size>, and those names can't be given to
+     * other variables. This only applies to variables created after it
+     * is called
+     *
+     * @param[in] first_block The block size of the first level, which
+     *                        is rounded up to a power of two. The
+     *                        default is 1024
+     * @param[in] levels      The number of levels. The default is 8
+     */
+    void set_summary_levels(size_t first_block, unsigned int levels)
+    {
+        _settings.summary_block  = first_block;
+        _settings.summary_levels = levels;
+    }
+
+    /**
+     * Set the time column of timestamped variables (see Timestamped).
+     * A time column is a variable of doubles holding the wall-clock
+     * time (in seconds since the epoch) at which each sample was
+     * written. Variables which share a time column are expected to be
+     * written in step; each time is that of the first write of the
+     * sample. Timestamps come from a cheap clock with a resolution of
+     * a few milliseconds. This only applies to variables created after
+     * it is called. The name of a time column in use can't be given to
+     * another variable, and a variable can't be timestamped if its
+     * time column would take the name of an existing one
+     *
+     * @param[in] name The name of the time column to share, or an empty
+     *                 string (the default) to give each variable its
+     *                 own time column called <name>_time
+     */
+    void set_time_column(const std::string& name)
+    {
+        _settings.time_column = name;
+    }
+
+    /**
+     * Rotate the output of every variable on a schedule, so that data
+     * can be picked up while we keep writing. At the start of each
+     * rotation period (and whenever a file reaches the maximum size),
+     * each variable closes its current file and moves on to the next
+     * part (see set_max_part_size())
+     *
+     * A variable only notices that a period has ended when it is next
+     * written to, so a variable which stops being written keeps its
+     * current file open (and out of the index) until its next write
+     * or until the MatFile is destroyed. The next part is normally
+     * opened in the background ahead of time and the finished one
+     * closed there, but the write which rotates waits if the next part
+     * isn't open yet, and with set_max_open_files() both happen within
+     * that write
+     *
+     * Every closed file is a finalized MAT file, and is appended to
+     * <dir>/rotation.index as a line "<start> <end> <file>", where
+     * start and end give the wall-clock range (in seconds since the
+     * epoch) the file covers. Files only appear in the index once
+     * they have been closed
+     *
+     * This only applies to variables created after it is called, and
+     * can only be called once
+     *
+     * @param[in] seconds The length of each rotation period, e.g. 3600
+     *                    to rotate every hour
+     * @param[in] bytes   If nonzero, the maximum size of each file (see
+     *                    set_max_part_size())
+     *
+     * @return True on success
+     */
+    bool set_rotation(unsigned int seconds, size_t bytes = 0)
+    {
+        if (!_is_ready || _rotation || seconds == 0 ||
+            (bytes > 0 && bytes < MIN_PART_SIZE))
+            return false;
+
+        _rotation.reset(new rotation_timer(
+            _settings.dir + separator() + "rotation.index", seconds));
+
+        _settings.rotation = _rotation.get();
+
+        if (bytes > 0)
+            set_max_part_size(bytes);
+
+        return true;
+    }
+
+    /**
+     * Buffer the writes of every variable in slabs leased from a pool
+     * shared by the whole MatFile, instead of in a stdio buffer per
+     * file. The pool never holds more than its budget, however many
+     * variables there are. When it runs out, the slab leased longest
+     * ago is written out and handed over. Only writes whose header
+     * update is deferred (see Frame::commit()) stay in a slab; the
+     * rest go to the file straight away as before. Compressed
+     * variables keep their own buffers
+     *
+     * A slab is written out some time after the writes that filled
+     * it, so a failure to write it is only reported by the call that
+     * caused it, if at all (see flush()). Samples lost that way are
+     * not counted in the variable's header, but its time column and
+     * summaries still cover them, and are longer than the variable
+     * from then on
+     *
+     * This only applies to variables created after it is called, and
+     * can only be called once
+     *
+     * @param[in] bytes     The budget, in bytes
+     * @param[in] slab_size The size of each slab. The default is 64 KiB
+     *
+     * @return True on success
+     */
+    bool set_buffer_budget(size_t bytes, size_t slab_size = 1 << 16)
+    {
+        if (!_is_ready || _pool)
+            return false;
+
+        _pool.reset(new buffer_pool(bytes, slab_size));
+        _settings.pool = _pool.get();
+
+        return true;
+    }
+
+    /**
+     * Get the budget set by set_buffer_budget()
+     *
+     * @return The budget in bytes, or 0 if there is no pool
+     */
+    size_t buffer_budget() const
+    {
+        return _pool ? _pool->budget() : 0;
+    }
+
+    /**
+     * Get how much of the buffer budget is currently leased
+     *
+     * @return The number of bytes in use
+     */
+    size_t buffer_usage() const
+    {
+        return _pool ? _pool->usage() : 0;
+    }
+
+    /**
+     * Limit how many variables keep their file open at once, so that
+     * there can be more variables than the process may have open
+     * files. Once the limit is reached, the file of the variable
+     * written least recently is closed, and reopened where it left off
+     * when it is next needed. Data buffered in the pool (see
+     * set_buffer_budget()) stays there until the next flush
+     *
+     * With a limit, the next part of a variable is opened when it is
+     * needed rather than ahead of time, and finished parts are closed
+     * straight away, so that every part counts against it. Indexes
+     * and manifests are still briefly opened in the background, so
+     * the limit should leave a little room below the process's own.
+     * This only applies to variables created after it is called, and
+     * can only be called once
+     *
+     * @param[in] files The maximum number of open files (at least 2)
+     *
+     * @return True on success
+     */
+    bool set_max_open_files(size_t files)
+    {
+        if (!_is_ready || _files)
+            return false;
+
+        _files.reset(new file_cache(files));
+        _settings.files = _files.get();
+
+        return true;
+    }
+
+    /**
+     * Set how much of each variable is saved when trigger() is called
+     * in Triggered mode. Each variable keeps its last pre_samples
+     * samples in a ring allocated when it is created, so that writing
+     * a sample costs a single store and no I/O. This only applies to
+     * variables created after it is called
+     *
+     * @param[in] pre_samples  Samples to keep from before a trigger.
+     *                         The default is 65536
+     * @param[in] post_samples Samples to save after a trigger. The
+     *                         default is 65536
+     */
+    void set_trigger_window(size_t pre_samples, size_t post_samples)
+    {
+        _settings.pre_trigger  = pre_samples;
+        _settings.post_trigger = post_samples;
+    }
+
+    /**
+     * Save the recent samples of every variable (in Triggered mode).
+     * Each variable saves the samples it kept from before the trigger,
+     * followed by the samples written to it after, to its own file in
+     * a new directory <dir>/triggerNNN, numbered from 001. Files are
+     * written in the background once a variable's post-trigger samples
+     * are in (or when the MatFile is destroyed), so this never blocks.
+     * A variable still capturing after the last trigger ignores this
+     * one. The variables of every Schema are included
+     *
+     * @return True if any variable started capturing
+     */
+    bool trigger()
+    {
+        if (!_is_ready || _running_mode != Triggered)
+            return false;
+
+        bool started = false;
+        for (size_t i = 0; i < _variables.size(); i++)
+        {
+            started =
+                _variables[i]->trigger(_trigger_count + 1) || started;
+        }
 
-        const int id = static_cast<int>(_variables.size());
+        for (size_t i = 0; i < _grouped.size(); i++)
+        {
+            started =
+                _grouped[i]->trigger(_trigger_count + 1) || started;
+        }
 
-        if (_name2id.find(name) != _name2id.end())
-            return _name2id[name];
-        else
-                _name2id[name] = id;
+        if (started)
+            _trigger_count++;
 
-        _variables.push_back( new Variable<T>(_dir,name) );
-        return id;
+        return started;
     }
 
     /**
@@ -650,18 +4127,33 @@ public:
      * @return True on success
      */
     template <typename T>
-    bool write(const std::string& name, const T& value) const
+    bool write(std::string_view name, const T& value) const
     {
-        if (!_is_ready)
-            return false;
+        const int id = _names.find(name, name_hash(name));
 
-        str_int_map::const_iterator iter =
-            _name2id.find(name);
-        if (iter == _name2id.end())
-            return false;
+        return id >= 0 &&
+            write(id, value);
+    }
 
-        return
-            write(iter->second, value);
+    /**
+     * Write the next data sample to the MAT file for the specified
+     * variable
+     *
+     * @tparam The type of this variable
+     *
+     * @param[in] key   The name of the variable to write to, hashed
+     *                  at compile time
+     * @param[in] value The value to write
+     *
+     * @return True on success
+     */
+    template <typename T>
+    bool write(const Key& key, const T& value) const
+    {
+        const int id = _names.find(key.name, key.hash);
+
+        return id >= 0 &&
+            write(id, value);
     }
 
     /**
@@ -674,7 +4166,8 @@ public:
      *                 from create()
      * @param[in] value The value to write
      *
-     * @return True on success
+     * @return True on success, or false if the variable doesn't exist
+     *         or was created with a different type
      */
     template <typename T>
     bool write(int id, const T& value) const
@@ -687,20 +4180,177 @@ public:
         if (_variables.size() <= _id)
             return false;
 
-        Variable<T>* var =
-            dynamic_cast<Variable<T>*>(_variables[id]);
+        variable_base* var = _variables[id];
+
+        return var->type() == mi_type<T>() &&
+            var->write(&value, 1) == 1;
+    }
+
+    /**
+     * Write a block of samples to the MAT file for the specified
+     * variable, without knowing their type at compile time
+     *
+     * @param[in] id    The ID of the variable to write to, obtained
+     *                  from create()
+     * @param[in] data  The samples, already of the variable's type
+     * @param[in] numel The number of samples
+     *
+     * @return The number of samples written
+     */
+    size_t write(int id, const void* data, size_t numel) const
+    {
+        const size_t _id = id;
+
+        if (!_is_ready || _variables.size() <= _id)
+            return 0;
 
         return
-            var->write(value);
+            _variables[id]->write(data, numel);
     }
 
 private:
 
-    std::string _dir;
-    bool        _is_ready;
-    str_int_map _name2id;
-    mode_t      _running_mode;
-    var_v       _variables;
+    /*
+     * Check whether a new variable can have this name, these options
+     * and this MatLab type. Neither the name nor those of the variables
+     * created along with it (see companions()) may already be taken
+     */
+    bool can_create(const std::string& name, int options,
+                    int type) const
+    {
+        if (mi_type_size(type) == 0 || !options_allowed(options) ||
+            _reserved.find(name, name_hash(name)) >= 0)
+            return false;
+
+        const std::vector<std::string> names = companions(name, options);
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (names[i] == name ||
+                _names.find(names[i], name_hash(names[i])) >= 0)
+                return false;
+        }
+
+        return true;
+    }
+
+    /*
+     * Get the names of the variables created along with a new one: its
+     * time column and its summaries
+     */
+    std::vector<std::string> companions(const std::string& name,
+                                        int options) const
+    {
+        std::vector<std::string> names;
+
+        if (options & Timestamped)
+            names.push_back(time_columns::column_name(_settings, name));
+
+        if (options & Summarized)
+        {
+            const std::vector<std::pair<std::string, size_t> > levels =
+                summarizer_base::levels(_settings, name);
+
+            for (size_t i = 0; i < levels.size(); i++)
+                names.push_back(levels[i].first);
+        }
+
+        return names;
+    }
+
+    /*
+     * Keep the names of the variables created along with a new one
+     * from being given to create()
+     */
+    void reserve(const std::string& name, int options)
+    {
+        const std::vector<std::string> names = companions(name, options);
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (_reserved.find(names[i], name_hash(names[i])) < 0)
+                _reserved.insert(names[i]);
+        }
+    }
+
+    /*
+     * Triggered variables keep nothing but their samples, so they
+     * can't have time columns or summaries
+     */
+    bool options_allowed(int options) const
+    {
+        return _running_mode != Triggered ||
+            (options & (Timestamped | Summarized)) == 0;
+    }
+
+    /*
+     * Create the first parts of new variables, on as many threads as
+     * there are cores (but with no fewer than 64 files each)
+     */
+    void create_files(const std::vector<variable_base*>& variables)
+    {
+        if (variables.empty())
+            return;
+
+        const std::string created = variable_base::created_now();
+
+#ifdef _WIN32
+        const int dir = -1;
+#else
+        const int dir = ::open(_settings.dir.c_str(),
+                               O_RDONLY | O_DIRECTORY);
+#endif
+
+        std::vector<FILE*> files(variables.size());
+        std::vector<long>  ends(variables.size());
+
+        std::atomic<size_t> next(0);
+
+        const std::function<void()> work = [&] {
+            for (size_t i = next++; i < variables.size(); i = next++)
+                files[i] = variables[i]->prepare_file(dir, created,
+                                                      ends[i]);
+        };
+
+        const size_t threads = std::min<size_t>(
+            std::max(std::thread::hardware_concurrency(), 1u),
+            (variables.size() + 63) / 64);
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; i++)
+            pool.emplace_back(work);
+
+        work();
+
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+
+        for (size_t i = 0; i < variables.size(); i++)
+            variables[i]->adopt_file(files[i], ends[i]);
+
+#ifndef _WIN32
+        if (dir >= 0)
+        {
+            ::fsync(dir);
+            ::close(dir);
+        }
+#endif
+    }
+
+    sample_clock                    _clock;
+    std::unique_ptr<file_cache>     _files;
+    std::vector<variable_base*>     _grouped;
+    bool                            _is_ready;
+    name_table                      _names;
+    std::unique_ptr<buffer_pool>    _pool;
+    name_table                      _reserved;
+    std::unique_ptr<rotation_timer> _rotation;
+    mode_t                          _running_mode;
+    var_settings                    _settings;
+    time_columns                    _time_columns;
+    int                             _trigger_count;
+    variable_arena                  _variables;
+    background_worker               _worker;
 };
 
 #endif // __MATFILE_H__
@@ -1,11 +1,15 @@
-#if defined(MSVS)
-#define _CRTDBG_MAP_ALLOC
-#include <crtdbg.h>
-#endif
-
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
 
 #include "MatFile.h"
+#include "MatReader.h"
 
 /**
  * MatFile unit test
@@ -30,15 +34,48 @@ public:
     }
 
     /**
-     * Run the unit tests. This should create 6 output files,
-     * all which should be loadable in MatLab
+     * Run the unit tests. This should create a number of output
+     * files, all which should be loadable in MatLab
      *
      * @return True if all tests passed
      */
     bool run(const std::string& path) const
     {
         return runTest1(path)
-                && runTest2(path);
+                && runTest2(path)
+                && runTest3(path)
+                && runTest4(path)
+                && runTest5(path)
+                && runTest6(path)
+                && runTest7(path)
+                && runTest8(path)
+                && runTest9(path)
+                && runTest10(path)
+                && runTest11(path)
+                && runTest12(path)
+                && runTest13(path)
+                && runTest14(path)
+                && runTest15(path)
+                && runTest16(path)
+                && runTest17(path)
+                && runTest18(path)
+                && runTest19(path)
+                && runTest20(path)
+                && runTest21(path)
+                && runTest22(path)
+                && runTest23(path)
+                && runTest24(path)
+                && runTest25(path)
+                && runTest26(path)
+                && runTest27(path)
+                && runTest28(path)
+                && runTest29(path)
+                && runTest30(path)
+                && runTest31(path)
+                && runTest32(path)
+                && runTest33(path)
+                && runTest34(path)
+                && runTest35(path);
     }
 
 private:
@@ -144,26 +181,1599 @@ private:
 
         return true;
     }
-};
 
-int main(int argc, char** argv)
-{
-    if (argc < 2)
+    bool runTest3(const std::string& path) const
     {
-        std::cout << "usage: " << argv[0] << " <output dir>"
-            << std::endl;
-        return 0;
+        const int num_samples = 1000;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Small enough to split the variable across 5 files:
+            matfile.set_max_part_size(1024);
+
+            const int id = matfile.create<int>("parts");
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < num_samples; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
+            }
+        }
+
+        std::ifstream manifest((path + "/parts.manifest").c_str());
+
+        std::string file;
+        size_t first, count, expected_first = 0;
+        int num_parts = 0;
+
+        while (manifest >> file >> first >> count)
+        {
+            std::ifstream part(file.c_str(), std::ios::binary |
+                                             std::ios::ate);
+            if (!part || part.tellg() > 1024)
+                return false;
+
+            if (first != expected_first)
+                return false;
+
+            expected_first += count;
+            num_parts++;
+        }
+
+        return num_parts == 5
+                && expected_first == (size_t)num_samples;
     }
 
-    MatFileTest test;
-    if (test.run(argv[1]))
-        std::cout << "passed." << std::endl;
-    else
-        std::cout << "failed." << std::endl;
+    bool runTest4(const std::string& path) const
+    {
+        const std::string index = path + "/rotation.index";
+        std::remove(index.c_str());
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            if (!matfile.set_rotation(1))
+                return false;
+
+            const int id = matfile.create<double>("rotated");
+            if (id < 0)
+                return false;
+
+            // Write across at least one rotation boundary:
+            for (int i = 0; i < 3; i++)
+            {
+                if (!matfile.write(id, i * 0.5))
+                    return false;
+
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(600));
+            }
+        }
+
+        std::ifstream in(index.c_str());
+
+        long long start, end, prev_end = 0;
+        std::string file;
+        int num_files = 0;
+
+        while (in >> start >> end >> file)
+        {
+            if (start > end || start < prev_end)
+                return false;
+
+            prev_end = end;
+            num_files++;
+        }
+
+        return num_files >= 2;
+    }
+
+    bool runTest5(const std::string& path) const
+    {
+        double doubles[] = { -0.1, 0.0,
+                              0.1, 0.2,
+                              0.3, 0.4,
+                              0.5, 0.6,
+                              0.7, 0.8 };
+
+        const int num_doubles = sizeof(doubles)/sizeof(double);
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path, MatFile::Level4);
+
+            const int double_id = matfile.create<double>("level4");
+            const int int8_id   = matfile.create<char>("level4_chars");
+
+            if (double_id < 0 || int8_id < 0)
+                return false;
+
+            for (int i = 0; i < num_doubles; i++)
+            {
+                if (!matfile.write(double_id, doubles[i]))
+                    return false;
+            }
+
+            // Level 4 has no int8 type:
+            if (matfile.write(int8_id, 'a'))
+                return false;
+        }
+
+        std::ifstream in((path + "/level4.mat").c_str(),
+                         std::ios::binary);
+
+        int header[5];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header)))
+            return false;
+
+        char name[7];
+        double data[sizeof(doubles)/sizeof(double)];
+
+        if (!in.read(name, sizeof(name)) ||
+            !in.read(reinterpret_cast<char*>(data), sizeof(data)))
+            return false;
+
+        return header[1] == 1
+                && header[2] == num_doubles
+                && header[4] == (int)sizeof(name)
+                && std::string(name) == "level4"
+                && std::memcmp(data, doubles, sizeof(data)) == 0;
+    }
+
+    bool runTest6(const std::string& path) const
+    {
+        const int num_samples = 1000;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            const int id = matfile.create<short>("mapped");
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < num_samples; i++)
+            {
+                if (!matfile.write(id, (short)(i - 500)))
+                    return false;
+            }
+        }
+
+        MatReader reader(path + "/mapped.mat");
+        if (!reader.is_ready() || reader.variables().size() != 1)
+            return false;
+
+        const MatReader::var_info* info = reader.find("mapped");
+        if (info == NULL || info->dims.size() != 2 ||
+            info->dims[0] != 1 || info->dims[1] != (size_t)num_samples)
+            return false;
+
+        // Wrong type:
+        if (!reader.get<int>("mapped").empty())
+            return false;
+
+        mat_span<const short> data = reader.get<short>("mapped");
+        if (data.size() != (size_t)num_samples)
+            return false;
+
+        for (int i = 0; i < num_samples; i++)
+        {
+            if (data[i] != i - 500)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runTest7(const std::string& path) const
+    {
+        // Reads the file written by runTest6:
+        if (!check_stream(path + "/mapped.mat"))
+            return false;
+
+#ifdef MATFILE_USE_ZLIB
+        std::ifstream in((path + "/mapped.mat").c_str(),
+                         std::ios::binary);
+
+        std::vector<char> contents(
+            (std::istreambuf_iterator<char>(in)),
+             std::istreambuf_iterator<char>());
+
+        if (contents.size() < 128)
+            return false;
+
+        // Compress the matrix element:
+        uLongf size = compressBound(contents.size() - 128);
+        std::vector<Bytef> compressed(size);
+
+        if (compress(compressed.data(), &size,
+                     reinterpret_cast<const Bytef*>(&contents[128]),
+                     contents.size() - 128) != Z_OK)
+            return false;
+
+        const std::string file = path + "/mapped_compressed.mat";
+        std::ofstream out(file.c_str(), std::ios::binary);
+
+        const int tag[] = { miCOMPRESSED, (int)size };
+
+        out.write(&contents[0], 128);
+        out.write(reinterpret_cast<const char*>(tag), sizeof(tag));
+        out.write(reinterpret_cast<const char*>(compressed.data()),
+                  size);
+        out.close();
+
+        if (!check_stream(file))
+            return false;
+#endif
+        return true;
+    }
+
+    bool runTest8(const std::string& path) const
+    {
+        const int num_samples = 5000;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            matfile.set_restart_interval(1024);
+
+            const int id =
+                matfile.create<double>("deflated", MatFile::Compressed);
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < num_samples; i++)
+            {
+                const bool ok = matfile.write(id, i * 0.25);
+#ifdef MATFILE_USE_ZLIB
+                if (!ok)
+                    return false;
+#else
+                // Compression isn't available:
+                if (ok)
+                    return false;
+#endif
+            }
+        }
+
+#ifdef MATFILE_USE_ZLIB
+        MatStream stream(path + "/deflated.mat", "deflated", 1000);
+        if (!stream.is_ready())
+            return false;
+
+        int expected = 0;
+
+        for (mat_span<const double> block = stream.next<double>();
+             !block.empty(); block = stream.next<double>())
+        {
+            for (size_t i = 0; i < block.size(); i++)
+            {
+                if (block[i] != (expected++) * 0.25)
+                    return false;
+            }
+        }
+
+        if (expected != num_samples)
+            return false;
+
+        std::vector<double> data;
+        if (!stream.read_all(data, 4) ||
+            data.size() != (size_t)num_samples)
+            return false;
+
+        for (int i = 0; i < num_samples; i++)
+        {
+            if (data[i] != i * 0.25)
+                return false;
+        }
+#endif
+        return true;
+    }
+
+    bool runTest9(const std::string& path) const
+    {
+        const int num_samples = 1000;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            matfile.set_index_stride(100);
+
+            const int id = matfile.create<int>("indexed", MatFile::Indexed);
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < num_samples; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
+            }
+        }
+
+        const std::string file = path + "/indexed.mat";
+
+        MatIndex index(file);
+        if (!index.is_ready() || index.entries().size() != 10)
+            return false;
+
+        const MatIndex::entry* entry = index.find_sample(250);
+        if (entry == NULL || entry->sample != 200)
+            return false;
+
+        MatStream stream(file, "indexed");
+
+        // The index should point straight at the sample:
+        std::vector<int> data;
+        if (!stream.read_range(entry->sample, 1, data) ||
+            data.size() != 1 || data[0] != 200 ||
+            entry->offset != stream.info().data_offset + 200 * sizeof(int))
+            return false;
+
+        const double time = index.entries()[3].time;
+
+        size_t first, count;
+        if (!index.sample_range(time, time, first, count) ||
+            first > 300 || first + count < 301)
+            return false;
+
+        return stream.read_range(first, count, data)
+                && data.size() == std::min<size_t>(count, num_samples - first)
+                && data[0] == (int)first;
+    }
+
+    bool runTest10(const std::string& path) const
+    {
+        const int num_samples = 500;
+
+        std::vector<int> data;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Make the variable roll over while we follow it:
+            matfile.set_max_part_size(1024);
+
+            const int id = matfile.create<int>("live");
+            if (id < 0)
+                return false;
+
+            // The header may not have reached the file yet, in which
+            // case poll() keeps looking for it:
+            MatTail tail(path, "live");
+
+            for (int i = 0; i < num_samples; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
 
-#if defined(MSVS)
-	_CrtDumpMemoryLeaks();
+                if (i % 50 == 0)
+                    tail.poll(data);
+            }
+
+            tail.poll(data);
+            if (data.empty())
+                return false;
+
+            for (size_t i = 0; i < data.size(); i++)
+            {
+                if (data[i] != (int)i)
+                    return false;
+            }
+        }
+
+        MatTail tail(path, "live");
+        tail.poll(data = std::vector<int>());
+
+        if (data.size() != (size_t)num_samples ||
+            tail.count() != (size_t)num_samples)
+            return false;
+
+        for (int i = 0; i < num_samples; i++)
+        {
+            if (data[i] != i)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runTest11(const std::string& path) const
+    {
+        // Put the variables written by runTest1 and runTest6 (and
+        // runTest7's compressed copy) into one file:
+        std::vector<std::string> files;
+        files.push_back(path + "/mapped.mat");
+        files.push_back(path + "/doubles.mat");
+#ifdef MATFILE_USE_ZLIB
+        files.push_back(path + "/mapped_compressed.mat");
 #endif
+        const std::string file = path + "/several.mat";
+        std::ofstream out(file.c_str(), std::ios::binary);
+
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            std::ifstream in(files[i].c_str(), std::ios::binary);
+
+            std::vector<char> contents(
+                (std::istreambuf_iterator<char>(in)),
+                 std::istreambuf_iterator<char>());
+
+            if (contents.size() < 128)
+                return false;
+
+            const size_t skip = i == 0 ? 0 : 128;
+            out.write(&contents[skip], contents.size() - skip);
+        }
+
+        out.close();
+
+        std::vector<MatReader::var_info> variables;
+        if (!MatReader::scan(file, variables) ||
+            variables.size() != files.size())
+            return false;
+
+        const char* names[] = { "mapped", "doubles", "mapped" };
+        const size_t numel[] = { 1000, 10, 1000 };
+
+        for (size_t i = 0; i < variables.size(); i++)
+        {
+            const MatReader::var_info& info = variables[i];
+
+            if (info.name != names[i] || info.numel != numel[i] ||
+                info.dims.size() != 2 || info.dims[0] != 1 ||
+                info.dims[1] != numel[i] ||
+                info.compressed != (i == 2))
+                return false;
+        }
+
+        // The mapped reader lists the same variables:
+        MatReader reader(file);
+        if (!reader.is_ready() ||
+            reader.variables().size() != variables.size() ||
+            reader.get<double>("doubles").size() != 10)
+            return false;
+
+        return check_stream(file);
+    }
+
+    bool runTest12(const std::string& path) const
+    {
+        // Write the samples of runTest6, and some doubles, the way a
+        // big endian machine would:
+        std::vector<char> contents(128, ' ');
+        contents[124] = 0x01; contents[125] = 0x00;
+        contents[126] = 'M';  contents[127] = 'I';
+
+        const int num_doubles = 37;
+
+        std::vector<short> shorts;
+        for (int i = 0; i < 1000; i++)
+            shorts.push_back(i - 500);
+
+        std::vector<double> doubles;
+        for (int i = 0; i < num_doubles; i++)
+            doubles.push_back(i * -1.5);
+
+        put_big_endian(contents, "mapped",  10, miINT16,
+                       shorts.data(),  shorts.size());
+        put_big_endian(contents, "doubles",  6, miDOUBLE,
+                       doubles.data(), doubles.size());
+
+        const std::string file = path + "/big_endian.mat";
+        std::ofstream out(file.c_str(), std::ios::binary);
+
+        out.write(contents.data(), contents.size());
+        out.close();
+
+        if (!check_stream(file))
+            return false;
+
+        MatStream stream(file, "doubles", 64);
+        if (!stream.is_ready() || !stream.info().swapped)
+            return false;
+
+        int expected = 0;
+
+        for (mat_span<const double> block = stream.next<double>();
+             !block.empty(); block = stream.next<double>())
+        {
+            for (size_t i = 0; i < block.size(); i++)
+            {
+                if (block[i] != (expected++) * -1.5)
+                    return false;
+            }
+        }
+
+        std::vector<double> range;
+        if (expected != num_doubles ||
+            !stream.read_range(30, 10, range) ||
+            range.size() != 7 || range[0] != 30 * -1.5)
+            return false;
+
+        // Can't be viewed in place:
+        MatReader reader(file);
+        return reader.is_ready() && reader.variables().size() == 2 &&
+            reader.get<double>("doubles").empty();
+    }
+
+    bool runTest13(const std::string& path) const
+    {
+        // Reads the files written by runTest6, runTest8 and runTest12
+        // as a different type:
+        MatReader reader(path + "/mapped.mat");
+        MatStream stream(path + "/mapped.mat", "mapped", 250);
+
+        std::vector<double> doubles;
+        std::vector<float>  floats;
+
+        if (!reader.read_as("mapped", doubles) ||
+            !stream.read_as(floats) ||
+            doubles.size() != 1000 || floats.size() != 1000)
+            return false;
+
+        for (int i = 0; i < 1000; i++)
+        {
+            if (doubles[i] != i - 500 || floats[i] != i - 500)
+                return false;
+        }
+
+        MatReader swapped(path + "/big_endian.mat");
+        MatStream swapped_stream(path + "/big_endian.mat", "doubles", 64);
+
+        std::vector<int> ints;
+
+        if (!swapped.read_as("doubles", floats) ||
+            !swapped_stream.read_as(ints) ||
+            floats.size() != 37 || ints.size() != 37)
+            return false;
+
+        for (int i = 0; i < 37; i++)
+        {
+            if (floats[i] != i * -1.5f || ints[i] != (int)(i * -1.5))
+                return false;
+        }
+
+#ifdef MATFILE_USE_ZLIB
+        MatStream deflated(path + "/deflated.mat", "deflated", 1000);
+
+        if (!deflated.read_as(floats) || floats.size() != 5000)
+            return false;
+
+        for (int i = 0; i < 5000; i++)
+        {
+            if (floats[i] != i * 0.25f)
+                return false;
+        }
+#endif
+        return true;
+    }
+
+    bool runTest14(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            MatFile::Handle<float> handle =
+                matfile.create_handle<float>("handled");
+            if (!handle.is_valid())
+                return false;
+
+            // A variable of the same name but a different type:
+            if (matfile.create_handle<double>("handled").is_valid() ||
+                matfile.write("handled", 1.0))
+                return false;
+
+            const float values[] = { 1.5f, 2.5f, 3.5f };
+
+            if (!handle.write(0.5f) || handle.write(values, 3) != 3)
+                return false;
+
+            if (MatFile::Handle<float>().write(0.5f))
+                return false;
+        }
+
+        MatReader reader(path + "/handled.mat");
+        mat_span<const float> data = reader.get<float>("handled");
+
+        return data.size() == 4 && data[0] == 0.5f && data[3] == 3.5f;
+    }
+
+    struct Voltage
+    {
+        typedef double type;
+        static const char* name() { return "voltage"; }
+    };
+
+    struct Counts
+    {
+        typedef int type;
+        static const char* name() { return "counts"; }
+    };
+
+    bool runTest15(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            MatFile::Schema<Voltage, Counts> telemetry(matfile);
+            if (!telemetry.is_ready())
+                return false;
+
+            for (int i = 0; i < 100; i++)
+            {
+                if (!telemetry.write(i * 0.5, i))
+                    return false;
+            }
+
+            if (!telemetry.write<Counts>(100))
+                return false;
+        }
+
+        MatReader voltage(path + "/voltage.mat");
+        MatReader counts(path + "/counts.mat");
+
+        mat_span<const double> volts = voltage.get<double>("voltage");
+        mat_span<const int>    ints  = counts.get<int>("counts");
+
+        return volts.size() == 100 && volts[99] == 49.5 &&
+            ints.size() == 101 && ints[100] == 100;
+    }
+
+    bool runTest16(const std::string& path) const
+    {
+        static constexpr MatFile::Key key("by_name_17");
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Enough variables to make the name table grow:
+            for (int i = 0; i < 20; i++)
+            {
+                if (matfile.create<int>("by_name_" + std::to_string(i))
+                        != i)
+                    return false;
+            }
+
+            if (matfile.create<int>("by_name_5") != 5)
+                return false;
+
+            const std::string name = "by_name_3";
+
+            if (!matfile.write(name, 3) ||
+                !matfile.write("by_name_11", 11) ||
+                !matfile.write(key, 17) ||
+                matfile.write("by_name_20", 20))
+                return false;
+        }
+
+        MatReader reader(path + "/by_name_17.mat");
+        mat_span<const int> data = reader.get<int>("by_name_17");
+
+        return data.size() == 1 && data[0] == 17;
+    }
+
+    bool runTest17(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Not a numeric class:
+            if (matfile.create("untyped", 4) != -1)
+                return false;
+
+            const int id = matfile.create("raw", mxINT16_CLASS);
+            if (id < 0)
+                return false;
+
+            const short block[] = { 1, 2, 3, 4, 5 };
+
+            if (matfile.write(id, block, 5) != 5 ||
+                !matfile.write(id, (short)6) ||
+                matfile.write(id, 7.0))
+                return false;
+        }
+
+        MatReader reader(path + "/raw.mat");
+        mat_span<const short> data = reader.get<short>("raw");
+
+        if (data.size() != 6)
+            return false;
+
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            if (data[i] != (short)(i + 1))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runTest18(const std::string& path) const
+    {
+        const double start = std::chrono::duration<double>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            const int lone_id =
+                matfile.create<float>("stamped", MatFile::Timestamped);
+
+            // Two variables sharing a time column:
+            matfile.set_time_column("group_time");
+
+            const int x_id =
+                matfile.create<int>("group_x", MatFile::Timestamped);
+            const int y_id =
+                matfile.create<int>("group_y", MatFile::Timestamped);
+
+            if (lone_id < 0 || x_id < 0 || y_id < 0)
+                return false;
+
+            for (int i = 0; i < 10; i++)
+            {
+                if (!matfile.write(lone_id, i * 1.0f) ||
+                    !matfile.write(x_id, i) || !matfile.write(y_id, i))
+                    return false;
+
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(2));
+            }
+
+            // One of the group gets ahead:
+            const int more[] = { 10, 11, 12 };
+            if (matfile.write(x_id, more, 3) != 3)
+                return false;
+        }
+
+        MatReader lone(path + "/stamped_time.mat");
+        MatReader group(path + "/group_time.mat");
+
+        mat_span<const double> lone_times =
+            lone.get<double>("stamped_time");
+        mat_span<const double> group_times =
+            group.get<double>("group_time");
+
+        if (lone_times.size() != 10 || group_times.size() != 13)
+            return false;
+
+        for (size_t i = 0; i < lone_times.size(); i++)
+        {
+            // Allow for the coarse clock's resolution:
+            if (lone_times[i] < start - 0.1 ||
+                lone_times[i] > start + 60 ||
+                (i > 0 && lone_times[i] < lone_times[i - 1]))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runTest19(const std::string& path) const
+    {
+        MatFile matfile(MatFile::RealTime,
+                        path);
+
+        MatFile::Handle<double> a = matfile.create_handle<double>("frame_a");
+        MatFile::Handle<int>    b = matfile.create_handle<int>("frame_b");
+
+        MatFile::Frame frame;
+
+        for (int i = 0; i < 10; i++)
+        {
+            frame.add(a, i * 0.5);
+            frame.add(b, i);
+
+            if (!frame.commit(i < 5))
+                return false;
+        }
+
+        const int more[] = { 10, 11 };
+        frame.add(b, more, 2);
+
+        if (!frame.commit(false))
+            return false;
+
+        // Only the first 5 frames have been published:
+        {
+            MatReader reader(path + "/frame_b.mat");
+            if (reader.get<int>("frame_b").size() != 5)
+                return false;
+        }
+
+        if (!matfile.flush())
+            return false;
+
+        MatReader doubles(path + "/frame_a.mat");
+        MatReader ints(path + "/frame_b.mat");
+
+        mat_span<const double> a_data = doubles.get<double>("frame_a");
+        mat_span<const int>    b_data = ints.get<int>("frame_b");
+
+        return a_data.size() == 10 && a_data[9] == 4.5 &&
+            b_data.size() == 12 && b_data[11] == 11;
+    }
+
+    bool runTest20(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            const int every_id = matfile.create<short>(
+                "every_tenth", 0, MatFile::Decimate, 10);
+            const int mean_id = matfile.create<double>(
+                "block_mean", 0, MatFile::Average, 4);
+            const int envelope_id = matfile.create<int>(
+                "envelope", MatFile::Timestamped, MatFile::Envelope, 5);
+
+            if (every_id < 0 || mean_id < 0 || envelope_id < 0)
+                return false;
+
+            for (int i = 0; i < 95; i++)
+            {
+                if (!matfile.write(every_id, (short)i))
+                    return false;
+            }
+
+            for (int i = 0; i < 10; i++)
+            {
+                if (!matfile.write(mean_id, i * 1.0))
+                    return false;
+            }
+
+            // Blocks span writes:
+            const int ints[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+            if (matfile.write(envelope_id, ints, 3) != 3 ||
+                matfile.write(envelope_id, ints + 3, 9) != 9)
+                return false;
+        }
+
+        MatReader every(path + "/every_tenth.mat");
+        mat_span<const short> kept = every.get<short>("every_tenth");
+
+        if (kept.size() != 10 || kept[0] != 0 || kept[9] != 90)
+            return false;
+
+        MatReader mean(path + "/block_mean.mat");
+        mat_span<const double> means = mean.get<double>("block_mean");
+
+        if (means.size() != 3 || means[0] != 1.5 || means[1] != 5.5 ||
+            means[2] != 8.5)
+            return false;
+
+        MatReader envelope(path + "/envelope.mat");
+        const MatReader::var_info* info = envelope.find("envelope");
+        mat_span<const int> pairs = envelope.get<int>("envelope");
+
+        const int expected[] = { 0, 4, 5, 9, 10, 11 };
+
+        if (info == NULL || info->dims.size() != 2 ||
+            info->dims[0] != 2 || info->dims[1] != 3 || pairs.size() != 6)
+            return false;
+
+        // One time per column:
+        MatReader times(path + "/envelope_time.mat");
+        if (times.get<double>("envelope_time").size() != 3)
+            return false;
+
+        return std::equal(pairs.begin(), pairs.end(), expected);
+    }
+
+    bool runTest21(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Blocks of 4, 8 and 16 samples (3 is rounded up to 4):
+            matfile.set_summary_levels(3, 3);
+
+            const int id = matfile.create<int>("summarized",
+                                               MatFile::Summarized);
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < 1000; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
+            }
+        }
+
+        MatReader level0(path + "/summarized_summary4.mat");
+        MatReader level2(path + "/summarized_summary16.mat");
+
+        mat_span<const double> fine   =
+            level0.get<double>("summarized_summary4");
+        mat_span<const double> coarse =
+            level2.get<double>("summarized_summary16");
+
+        // Columns of (min, max, mean), the last one partial:
+        if (fine.size() != 3 * 250 || coarse.size() != 3 * 63)
+            return false;
+
+        if (fine[0] != 0 || fine[1] != 3 || fine[2] != 1.5)
+            return false;
+
+        const double* last = &coarse[coarse.size() - 3];
+        return last[0] == 992 && last[1] == 999 && last[2] == 995.5;
+    }
+
+    bool runTest22(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::Triggered,
+                            path);
+
+            matfile.set_trigger_window(100, 50);
+
+            const int id = matfile.create<int>("fault");
+            if (id < 0)
+                return false;
+
+            for (int i = 0; i < 1000; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
+            }
+
+            // Nothing is written until a trigger:
+            if (std::ifstream(path + "/fault.mat"))
+                return false;
+
+            if (!matfile.trigger() || matfile.trigger())
+                return false;
+
+            for (int i = 1000; i < 1100; i++)
+            {
+                if (!matfile.write(id, i))
+                    return false;
+            }
+        }
+
+        MatReader reader(path + "/trigger001/fault.mat");
+
+        mat_span<const int> samples = reader.get<int>("fault");
+
+        // 100 samples before the trigger and 50 after:
+        if (samples.size() != 150)
+            return false;
+
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            if (samples[i] != static_cast<int>(900 + i))
+                return false;
+        }
+
+        return !std::ifstream(path + "/trigger002/fault.mat");
+    }
+
+    bool runTest23(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Room for two slabs of 1024 ints:
+            if (!matfile.set_buffer_budget(8192, 4096) ||
+                matfile.buffer_budget() != 8192)
+                return false;
+
+            MatFile::Handle<int> pooled[3];
+            for (int i = 0; i < 3; i++)
+            {
+                pooled[i] = matfile.create_handle<int>(
+                    "pooled" + std::to_string(i));
+            }
+
+            MatFile::Frame frame;
+
+            for (int i = 0; i < 5000; i++)
+            {
+                for (int j = 0; j < 3; j++)
+                    frame.add(pooled[j], i * 3 + j);
+
+                if (!frame.commit(false) ||
+                    matfile.buffer_usage() > matfile.buffer_budget())
+                    return false;
+            }
+
+            if (matfile.buffer_usage() != 8192)
+                return false;
+        }
+
+        for (int j = 0; j < 3; j++)
+        {
+            const std::string name = "pooled" + std::to_string(j);
+
+            MatReader reader(path + "/" + name + ".mat");
+            mat_span<const int> data = reader.get<int>(name);
+
+            if (data.size() != 5000)
+                return false;
+
+            for (size_t i = 0; i < data.size(); i++)
+            {
+                if (data[i] != static_cast<int>(i * 3 + j))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool runTest24(const std::string& path) const
+    {
+        // Enough variables to span several blocks of the arena:
+        const int count = 200;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            for (int i = 0; i < count; i++)
+            {
+                const std::string name = "many" + std::to_string(i);
+
+                const int id = i % 2 ? matfile.create<double>(name) :
+                    matfile.create(name, mxINT16_CLASS);
+                if (id != i)
+                    return false;
+            }
+
+            for (int i = 0; i < count; i++)
+            {
+                const bool ok = i % 2 ?
+                    matfile.write<double>(i, i * 0.5) :
+                    matfile.write<short>(i, static_cast<short>(i));
+                if (!ok)
+                    return false;
+            }
+
+            if (!matfile.flush())
+                return false;
+        }
+
+        MatReader odd(path + "/many199.mat");
+        MatReader even(path + "/many100.mat");
+
+        mat_span<const double> d = odd.get<double>("many199");
+        mat_span<const short>  s = even.get<short>("many100");
+
+        return d.size() == 1 && d[0] == 99.5 &&
+            s.size() == 1 && s[0] == 100;
+    }
+
+    bool runTest25(const std::string& path) const
+    {
+        const int count = 20;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            if (!matfile.set_max_open_files(4) ||
+                !matfile.set_buffer_budget(8192, 4096))
+                return false;
+
+            std::vector<MatFile::Handle<int>> handles;
+            for (int i = 0; i < count; i++)
+            {
+                handles.push_back(matfile.create_handle<int>(
+                    "cached" + std::to_string(i)));
+                if (!handles.back().is_valid())
+                    return false;
+            }
+
+            MatFile::Frame frame;
+
+            // Half of the writes leave their data in the pool:
+            for (int n = 0; n < 500; n++)
+            {
+                for (int i = 0; i < count; i++)
+                    frame.add(handles[i], n * count + i);
+
+                if (!frame.commit(n % 2 == 0))
+                    return false;
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const std::string name = "cached" + std::to_string(i);
+
+            MatReader reader(path + "/" + name + ".mat");
+            mat_span<const int> data = reader.get<int>(name);
+
+            if (data.size() != 500)
+                return false;
+
+            for (size_t n = 0; n < data.size(); n++)
+            {
+                if (data[n] != static_cast<int>(n * count + i))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool runTest26(const std::string& path) const
+    {
+        MatFile matfile(MatFile::RealTime,
+                        path);
+
+        const int unused  = matfile.create<int>("lazy_unused",
+                                                MatFile::Timestamped);
+        const int written = matfile.create<int>("lazy_written");
+
+        if (unused < 0 || written < 0)
+            return false;
+
+        // No file until the first sample:
+        if (std::ifstream(path + "/lazy_written.mat"))
+            return false;
+
+        if (!matfile.write(written, 7))
+            return false;
+
+        MatReader reader(path + "/lazy_written.mat");
+        mat_span<const int> data = reader.get<int>("lazy_written");
+
+        return data.size() == 1 && data[0] == 7 &&
+            !std::ifstream(path + "/lazy_unused.mat") &&
+            !std::ifstream(path + "/lazy_unused_time.mat");
+    }
+
+    bool runTest27(const std::string& path) const
+    {
+        std::vector<std::string> names;
+        for (int i = 0; i < 300; i++)
+            names.push_back("bulk" + std::to_string(i));
+
+        for (int cached = 0; cached < 2; cached++)
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            if (cached && !matfile.set_max_open_files(16))
+                return false;
+
+            const int first = matfile.create<float>("bulk0");
+
+            const std::vector<int> ids =
+                matfile.create_many<float>(names);
+
+            if (ids.size() != names.size() || ids[0] != first)
+                return false;
+
+            // Files are created straight away:
+            if (!std::ifstream(path + "/bulk299.mat"))
+                return false;
+
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                if (ids[i] != static_cast<int>(i) ||
+                    !matfile.write(ids[i], i * 0.5f))
+                    return false;
+            }
+        }
+
+        for (int i = 1; i < 300; i += 149)
+        {
+            MatReader reader(path + "/" + names[i] + ".mat");
+            mat_span<const float> data = reader.get<float>(names[i]);
+
+            if (data.size() != 1 || data[0] != i * 0.5f)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runTest28(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Too small for any header:
+            if (matfile.set_max_part_size(100) ||
+                matfile.set_rotation(3600, 100) ||
+                !matfile.set_max_part_size(MIN_PART_SIZE))
+                return false;
+
+            // The header alone is bigger than a part, so each part
+            // holds a single sample:
+            const int id = matfile.create<double>(
+                "tiny_parts_with_a_long_name");
+            if (id < 0)
+                return false;
+
+            const double data[] = { 1, 2, 3 };
+            if (matfile.write(id, data, 3) != 3)
+                return false;
+        }
+
+        for (int i = 1; i <= 3; i++)
+        {
+            std::string file = path + "/tiny_parts_with_a_long_name";
+            if (i > 1)
+                file += "_part00" + std::to_string(i);
+
+            MatReader reader(file + ".mat");
+            mat_span<const double> part =
+                reader.get<double>("tiny_parts_with_a_long_name");
+
+            if (part.size() != 1 || part[0] != i)
+                return false;
+        }
+
+        return !std::ifstream(path +
+            "/tiny_parts_with_a_long_name_part004.mat");
+    }
+
+    bool runTest29(const std::string& path) const
+    {
+        const int count = 500;
+        const int limit = 16;
+
+        const int before = open_descriptors();
+        int most = before;
+
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Parts of about 200 samples, so every variable rolls over:
+            if (!matfile.set_max_open_files(limit) ||
+                !matfile.set_max_part_size(1024))
+                return false;
+
+            std::vector<int> ids;
+            for (int i = 0; i < count; i++)
+            {
+                ids.push_back(matfile.create<int>(
+                    "fd_limit" + std::to_string(i)));
+            }
+
+            for (int n = 0; n < 300; n++)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    if (!matfile.write(ids[i], n))
+                        return false;
+                }
+
+                most = std::max(most, open_descriptors());
+            }
+        }
+
+        // Allow for the odd index or manifest being appended to in the
+        // background:
+        if (before >= 0 && most > before + limit + 2)
+            return false;
+
+        MatReader reader(path + "/fd_limit499_part002.mat");
+        mat_span<const int> data = reader.get<int>("fd_limit499");
+
+        return data.size() > 0 && data[data.size() - 1] == 299;
+    }
+
+    bool runTest30(const std::string& path) const
+    {
+        const std::string dir = path + "/schema_trigger";
+        if (!make_dir(dir))
+            return false;
+
+        {
+            MatFile matfile(MatFile::Triggered,
+                            dir);
+
+            matfile.set_trigger_window(10, 5);
+
+            MatFile::Schema<Voltage, Counts> telemetry(matfile);
+
+            for (int i = 0; i < 50; i++)
+            {
+                if (!telemetry.write(i * 0.5, i))
+                    return false;
+            }
+
+            if (!matfile.trigger())
+                return false;
+
+            for (int i = 50; i < 60; i++)
+            {
+                if (!telemetry.write(i * 0.5, i))
+                    return false;
+            }
+        }
+
+        MatReader reader(dir + "/trigger001/counts.mat");
+        mat_span<const int> counts = reader.get<int>("counts");
+
+        return counts.size() == 15 && counts[0] == 40 &&
+            counts[14] == 54;
+    }
+
+    bool runTest31(const std::string& path) const
+    {
+        MatFile matfile(MatFile::RealTime,
+                        path);
+
+        // Two slabs and two open files for three variables:
+        if (!matfile.set_buffer_budget(8192, 4096) ||
+            !matfile.set_max_open_files(2))
+            return false;
+
+        MatFile::Handle<int> a = matfile.create_handle<int>("lost_a");
+        MatFile::Handle<int> b = matfile.create_handle<int>("lost_b");
+        MatFile::Handle<int> c = matfile.create_handle<int>("lost_c");
+
+        MatFile::Frame frame;
+
+        frame.add(a, 1);
+        frame.add(b, 2);
+        if (!frame.commit(false))
+            return false;
+
+        // lost_a can't be reopened once c closes it:
+        std::remove((path + "/lost_a.mat").c_str());
+
+        frame.add(c, 3);
+        if (!frame.commit(false))
+            return false;
+
+        // Taking lost_a's slab loses its sample, which flush reports:
+        return !matfile.flush();
+    }
+
+    bool runTest32(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime,
+                            path);
+
+            // Only gone_a and gone_d share the pool, which has room for
+            // one slab:
+            if (!matfile.set_max_open_files(2))
+                return false;
+
+            const int b = matfile.create<int>("gone_b");
+            const int c = matfile.create<int>("gone_c");
+
+            if (!matfile.set_buffer_budget(4096, 4096))
+                return false;
+
+            MatFile::Handle<int> a = matfile.create_handle<int>("gone_a");
+
+            const int d = matfile.create<double>(
+                "gone_d", 0, MatFile::Average, 10);
+
+            MatFile::Frame frame;
+            frame.add(a, 1);
+            if (!frame.commit(false))
+                return false;
+
+            // Close gone_a's file, then take it away:
+            if (!matfile.write(b, 2) || !matfile.write(c, 3))
+                return false;
+
+            std::remove((path + "/gone_a.mat").c_str());
+
+            // Nothing is written until gone_d is destroyed, after
+            // gone_a, when it needs the slab gone_a had:
+            for (int i = 0; i < 3; i++)
+            {
+                if (!matfile.write(d, 1.0))
+                    return false;
+            }
+        }
+
+        MatReader reader(path + "/gone_d.mat");
+        mat_span<const double> data = reader.get<double>("gone_d");
+
+        return data.size() == 1 && data[0] == 1.0;
+    }
+
+    bool runTest33(const std::string& path) const
+    {
+        MatFile matfile(MatFile::Triggered,
+                        path);
+
+        // bool has no MatLab class:
+        if (matfile.create<bool>("flag") != -1 ||
+            matfile.create<bool>("flag", 0, MatFile::Decimate, 2) != -1 ||
+            matfile.create_handle<bool>("flag").is_valid() ||
+            matfile.create_many<bool>({ "flag" })[0] != -1)
+            return false;
+
+        if (matfile.create<int>("flag") != 0 || !matfile.trigger())
+            return false;
+
+        // Triggered variables can't have time columns or summaries:
+        MatFile::Schema<Voltage> schema(matfile, MatFile::Timestamped);
+
+        return matfile.create<int>("stamped", MatFile::Timestamped) == -1 &&
+            matfile.create("summed", mxDOUBLE_CLASS,
+                           MatFile::Summarized) == -1 &&
+            !schema.is_ready();
+    }
+
+    bool runTest34(const std::string& path) const
+    {
+        {
+            MatFile matfile(MatFile::RealTime, path);
+
+            const int clock = matfile.create<double>("clock",
+                                                     MatFile::Timestamped);
+            if (clock < 0 || !matfile.write(clock, 1.0))
+                return false;
+
+            // Time column names can't be taken, either way round:
+            if (matfile.create<int>("clock_time") != -1 ||
+                matfile.create<int>("tick_time") < 0 ||
+                matfile.create<int>("tick", MatFile::Timestamped) != -1 ||
+                matfile.create<int>("self", MatFile::Timestamped) < 0)
+                return false;
+
+            matfile.set_time_column("shared_time");
+            if (matfile.create_many<int>({ "left", "shared_time" },
+                                         MatFile::Timestamped)[1] != -1 ||
+                matfile.create<int>("right", MatFile::Timestamped) < 0)
+                return false;
+        }
+
+        MatReader reader(path + "/clock_time.mat");
+        return reader.get<double>("clock_time").size() == 1;
+    }
+
+    bool runTest35(const std::string& path) const
+    {
+        MatFile matfile(MatFile::RealTime,
+                        path);
+
+        matfile.set_summary_levels(3, 2);
+
+        // Summary names can't be taken, either way round:
+        if (matfile.create<double>("trace", MatFile::Summarized) < 0 ||
+            matfile.create<double>("trace_summary4") != -1 ||
+            matfile.create<double>("trace_summary8") != -1 ||
+            matfile.create<double>("trace_summary16") < 0 ||
+            matfile.create<int>("scope_summary8") < 0 ||
+            matfile.create_many<int>({ "scope" },
+                                     MatFile::Summarized)[0] != -1)
+            return false;
+
+        // An envelope has no summaries, so it takes no names:
+        return matfile.create<double>("band", MatFile::Summarized,
+                                      MatFile::Envelope, 4) >= 0 &&
+            matfile.create<double>("band_summary4") >= 0;
+    }
+
+    /*
+     * Count our open file descriptors, or return -1 if we can't tell
+     */
+    static int open_descriptors()
+    {
+        DIR* dir = ::opendir("/proc/self/fd");
+        if (!dir)
+            return -1;
+
+        int count = 0;
+        while (::readdir(dir))
+            count++;
+
+        ::closedir(dir);
+        return count;
+    }
+
+    template <typename T>
+    static void put_big_endian(std::vector<char>& contents,
+                               const std::string& name, int mx_class,
+                               int mi_type, const T* data, size_t numel)
+    {
+        const size_t name_bytes = (name.size() + 7) & ~size_t(7);
+        const size_t data_bytes = (numel * sizeof(T) + 7) & ~size_t(7);
+
+        std::vector<char> element;
+
+        put_swapped<int>(element, miMATRIX);
+        put_swapped<int>(element, 48 + name_bytes + data_bytes);
+        put_swapped<int>(element, miUINT32);
+        put_swapped<int>(element, 8);
+        put_swapped<int>(element, mx_class);
+        put_swapped<int>(element, 0);
+        put_swapped<int>(element, miINT32);
+        put_swapped<int>(element, 8);
+        put_swapped<int>(element, 1);
+        put_swapped<int>(element, numel);
+        put_swapped<int>(element, miINT8);
+        put_swapped<int>(element, name.size());
+
+        element.insert(element.end(), name.begin(), name.end());
+        element.resize(element.size() + name_bytes - name.size());
+
+        put_swapped<int>(element, mi_type);
+        put_swapped<int>(element, numel * sizeof(T));
+
+        for (size_t i = 0; i < numel; i++)
+            put_swapped<T>(element, data[i]);
+
+        element.resize(element.size() + data_bytes - numel * sizeof(T));
+
+        contents.insert(contents.end(), element.begin(), element.end());
+    }
+
+    template <typename T>
+    static void put_swapped(std::vector<char>& contents, T value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+
+        for (size_t i = sizeof(T); i > 0; i--)
+            contents.push_back(bytes[i - 1]);
+    }
+
+    bool check_stream(const std::string& file) const
+    {
+        MatStream stream(file, "mapped", 256);
+        if (!stream.is_ready())
+            return false;
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            int expected = -500;
+
+            for (mat_span<const short> block = stream.next<short>();
+                 !block.empty(); block = stream.next<short>())
+            {
+                if (block.size() > 128)
+                    return false;
+
+                for (size_t i = 0; i < block.size(); i++)
+                {
+                    if (block[i] != expected++)
+                        return false;
+                }
+            }
+
+            if (expected != 500 || !stream.rewind())
+                return false;
+        }
+
+        return true;
+    }
+};
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: " << argv[0] << " <output dir>"
+            << std::endl;
+        return 0;
+    }
+
+    MatFileTest test;
+    if (test.run(argv[1]))
+        std::cout << "passed." << std::endl;
+    else
+        std::cout << "failed." << std::endl;
 
     return 0;
 }
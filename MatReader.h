@@ -0,0 +1,1929 @@
+#ifndef __MATREADER_H__
+#define __MATREADER_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef MATFILE_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define MATREADER_HAS_SPAN
+#endif
+#endif
+
+#include "MatFile.h"
+
+/*
+ * Reverse the bytes of each of count U-sized samples at ptr. The
+ * compiler turns the inner loop into a single byte swap instruction
+ */
+template <typename U>
+inline void mat_swap_each(unsigned char* ptr, size_t count)
+{
+    for (size_t i = 0; i < count; i++, ptr += sizeof(U))
+    {
+        U value, swapped = 0;
+        std::memcpy(&value, ptr, sizeof(U));
+
+        for (size_t j = 0; j < sizeof(U); j++, value >>= 8)
+            swapped = (swapped << 8) | (value & 0xFF);
+
+        std::memcpy(ptr, &swapped, sizeof(U));
+    }
+}
+
+/**
+ * Reverse the byte order of each sample in a buffer, in place. Uses
+ * SSSE3/AVX2 byte shuffles or NEON byte reversal if the compiler
+ * targets them (e.g. -mavx2), with a scalar loop for what is left
+ *
+ * @param[in,out] data  The samples
+ * @param[in]     bytes The size of the buffer. A partial sample at
+ *                      the end is left alone
+ * @param[in]     width The size of each sample, in bytes
+ */
+inline void mat_byte_swap(void* data, size_t bytes, size_t width)
+{
+    unsigned char* ptr = static_cast<unsigned char*>(data);
+    size_t i = 0;
+
+    if (width != 2 && width != 4 && width != 8)
+        return;
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+    /*
+     * Shuffle control that reverses each sample within a 16 byte lane:
+     */
+    alignas(32) unsigned char order[32];
+    for (size_t j = 0; j < sizeof(order); j++)
+        order[j] = (j % 16) / width * width + width - 1 - j % width;
+#endif
+
+#if defined(__AVX2__)
+    const __m256i mask256 =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(order));
+
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i* p = reinterpret_cast<__m256i*>(ptr + i);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(
+                                   _mm256_loadu_si256(p), mask256));
+    }
+#endif
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+    const __m128i mask128 =
+        _mm_load_si128(reinterpret_cast<const __m128i*>(order));
+
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i* p = reinterpret_cast<__m128i*>(ptr + i);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p),
+                                             mask128));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= bytes; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(ptr + i);
+
+        if (width == 2)
+            v = vrev16q_u8(v);
+        else if (width == 4)
+            v = vrev32q_u8(v);
+        else
+            v = vrev64q_u8(v);
+
+        vst1q_u8(ptr + i, v);
+    }
+#endif
+
+    const size_t count = (bytes - i) / width;
+
+    if (width == 2)
+        mat_swap_each<std::uint16_t>(ptr + i, count);
+    else if (width == 4)
+        mat_swap_each<std::uint32_t>(ptr + i, count);
+    else
+        mat_swap_each<std::uint64_t>(ptr + i, count);
+}
+
+/*
+ * Convert count samples from type S to type U, one at a time (which
+ * the compiler is free to vectorize itself)
+ */
+template <typename S, typename U>
+inline void mat_convert_scalar(const S* src, size_t count, U* dst)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = static_cast<U>(src[i]);
+}
+
+/*
+ * Convert count samples from type S to type U. Specialized below for
+ * the conversions we have vector kernels for
+ */
+template <typename S, typename U>
+inline void mat_convert(const S* src, size_t count, U* dst)
+{
+    mat_convert_scalar(src, count, dst);
+}
+
+#ifdef __AVX2__
+
+/*
+ * Explicitly vectorized conversions for the common cases of reading
+ * ADC samples and single precision data as double or float. Each
+ * handles what doesn't fill a vector with the scalar loop
+ */
+template <>
+inline void mat_convert(const std::int16_t* src, size_t count,
+                        double* dst)
+{
+    size_t i = 0;
+
+#ifdef __AVX512F__
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i in = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(src + i));
+
+        _mm512_storeu_pd(dst + i, _mm512_cvtepi32_pd(
+                                      _mm256_cvtepi16_epi32(in)));
+    }
+#endif
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i in = _mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(src + i));
+
+        _mm256_storeu_pd(dst + i, _mm256_cvtepi32_pd(
+                                      _mm_cvtepi16_epi32(in)));
+    }
+
+    mat_convert_scalar(src + i, count - i, dst + i);
+}
+
+template <>
+inline void mat_convert(const std::int16_t* src, size_t count,
+                        float* dst)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i in = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(src + i));
+
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(
+                                      _mm256_cvtepi16_epi32(in)));
+    }
+
+    mat_convert_scalar(src + i, count - i, dst + i);
+}
+
+template <>
+inline void mat_convert(const std::int32_t* src, size_t count,
+                        double* dst)
+{
+    size_t i = 0;
+
+#ifdef __AVX512F__
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i in = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(src + i));
+
+        _mm512_storeu_pd(dst + i, _mm512_cvtepi32_pd(in));
+    }
+#endif
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i in = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(src + i));
+
+        _mm256_storeu_pd(dst + i, _mm256_cvtepi32_pd(in));
+    }
+
+    mat_convert_scalar(src + i, count - i, dst + i);
+}
+
+template <>
+inline void mat_convert(const float* src, size_t count, double* dst)
+{
+    size_t i = 0;
+
+#ifdef __AVX512F__
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(dst + i,
+                         _mm512_cvtps_pd(_mm256_loadu_ps(src + i)));
+#endif
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(dst + i,
+                         _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+
+    mat_convert_scalar(src + i, count - i, dst + i);
+}
+
+template <>
+inline void mat_convert(const double* src, size_t count, float* dst)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm256_cvtpd_ps(_mm256_loadu_pd(src + i)));
+
+    mat_convert_scalar(src + i, count - i, dst + i);
+}
+
+#endif
+
+/**
+ * Convert samples stored as the given MAT data type to U
+ *
+ * @param[in]  type  The stored data type (miDOUBLE, miINT16, etc.)
+ * @param[in]  src   The stored samples
+ * @param[in]  count The number of samples
+ * @param[out] dst   The converted samples
+ *
+ * @return False if type isn't a numeric data type
+ */
+template <typename U>
+inline bool mat_convert_from(int type, const void* src, size_t count,
+                             U* dst)
+{
+    switch (type)
+    {
+    case miINT8:
+        mat_convert(static_cast<const std::int8_t*>(src), count, dst);
+        break;
+    case miUINT8:
+        mat_convert(static_cast<const std::uint8_t*>(src), count, dst);
+        break;
+    case miINT16:
+        mat_convert(static_cast<const std::int16_t*>(src), count, dst);
+        break;
+    case miUINT16:
+        mat_convert(static_cast<const std::uint16_t*>(src), count, dst);
+        break;
+    case miINT32:
+        mat_convert(static_cast<const std::int32_t*>(src), count, dst);
+        break;
+    case miUINT32:
+        mat_convert(static_cast<const std::uint32_t*>(src), count, dst);
+        break;
+    case miSINGLE:
+        mat_convert(static_cast<const float*>(src), count, dst);
+        break;
+    case miDOUBLE:
+        mat_convert(static_cast<const double*>(src), count, dst);
+        break;
+    case miINT64:
+        mat_convert(static_cast<const std::int64_t*>(src), count, dst);
+        break;
+    case miUINT64:
+        mat_convert(static_cast<const std::uint64_t*>(src), count, dst);
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef MATREADER_HAS_SPAN
+
+template <typename T>
+using mat_span = std::span<T>;
+
+#else
+
+/*
+ * A minimal stand-in for std::span when building for standards
+ * earlier than C++20
+ */
+template <typename T>
+class mat_span
+{
+public:
+
+    mat_span()
+        : _data(NULL), _size(0)
+    {
+    }
+
+    mat_span(T* data, size_t size)
+        : _data(data), _size(size)
+    {
+    }
+
+    T* begin() const
+    {
+        return _data;
+    }
+
+    T* data() const
+    {
+        return _data;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    T* end() const
+    {
+        return _data + _size;
+    }
+
+    T& operator[](size_t index) const
+    {
+        return _data[index];
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+
+    T*     _data;
+    size_t _size;
+};
+
+#endif
+
+/**
+ * Reads Level 5 MAT files, such as those written by MatFile, by
+ * mapping them into memory. Numeric data is returned as views into
+ * the mapping, so nothing is copied
+ *
+ * This uses POSIX mmap(), and so is not available on Windows
+ */
+class MatReader
+{
+public:
+
+    /**
+     * Describes one variable (miMATRIX element) in a file
+     */
+    struct var_info
+    {
+        std::string         name;        /**< Variable name */
+        int                 mx_class;    /**< Array class */
+        int                 mi_type;     /**< Type of the stored data */
+        std::vector<size_t> dims;        /**< Dimensions */
+        size_t              numel;       /**< Number of elements */
+        bool                compressed;  /**< Stored as miCOMPRESSED */
+        bool                swapped;     /**< Stored in the opposite
+                                              byte order to ours */
+        size_t              offset;      /**< Offset of the element */
+        size_t              size;        /**< Size of the element,
+                                              including its tag */
+        size_t              data_offset; /**< Offset of the real part
+                                              data. For compressed
+                                              variables, this is within
+                                              the inflated element */
+        size_t              data_bytes;  /**< Bytes of real part data */
+    };
+
+    /**
+     * Constructor
+     *
+     * @param[in] file The MAT file to read
+     */
+    MatReader(const std::string& file)
+        : _data(NULL), _is_ready(false), _size(0), _variables()
+    {
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            _size = info.st_size;
+
+            void* addr = ::mmap(NULL, _size, PROT_READ, MAP_SHARED, fd,
+                                0);
+            if (addr != MAP_FAILED)
+                _data = static_cast<const unsigned char*>(addr);
+        }
+
+        ::close(fd);
+
+        _is_ready = _data && parse();
+    }
+
+    /**
+     * Destructor
+     */
+    ~MatReader()
+    {
+        if (_data)
+            ::munmap(const_cast<unsigned char*>(_data), _size);
+    }
+
+    MatReader(const MatReader& copy)            = delete;
+    MatReader& operator=(const MatReader& rhs) = delete;
+
+    /**
+     * Look up a variable by name
+     *
+     * @param[in] name The name of the variable
+     *
+     * @return Information about the variable, or NULL if there is no
+     *         such variable
+     */
+    const var_info* find(const std::string& name) const
+    {
+        for (size_t i = 0; i < _variables.size(); i++)
+        {
+            if (_variables[i].name == name)
+                return &_variables[i];
+        }
+
+        return NULL;
+    }
+
+    /**
+     * Get a view of a variable's data directly from the mapped file
+     *
+     * @tparam T The type of the stored data. This must match the type
+     *           the data was written with exactly
+     *
+     * @param[in] name The name of the variable
+     *
+     * @return The data, or an empty view if the variable does not exist,
+     *         was stored with a different type or byte order, or is
+     *         compressed
+     */
+    template <typename T>
+    mat_span<const T> get(const std::string& name) const
+    {
+        const var_info* info = find(name);
+
+        if (info == NULL || info->compressed || info->swapped ||
+            info->mi_type != mi_type<T>())
+            return mat_span<const T>();
+
+        return mat_span<const T>(
+            reinterpret_cast<const T*>(_data + info->data_offset),
+            info->data_bytes / sizeof(T));
+    }
+
+    /**
+     * Read a variable's data converted to type U, whatever type it was
+     * stored as. Samples are converted straight out of the mapping;
+     * ones stored in the opposite byte order are swapped a small chunk
+     * at a time on the way
+     *
+     * @tparam U The type to convert to
+     *
+     * @param[in]  name The name of the variable
+     * @param[out] data The converted samples
+     *
+     * @return False if the variable does not exist, is not numeric, or
+     *         is compressed
+     */
+    template <typename U>
+    bool read_as(const std::string& name, std::vector<U>& data) const
+    {
+        const var_info* info = find(name);
+
+        if (info == NULL || info->compressed || info->mi_type == 0)
+            return false;
+
+        const size_t width = mi_type_size(info->mi_type);
+        const unsigned char* src = _data + info->data_offset;
+
+        data.resize(info->data_bytes / width);
+
+        if (!info->swapped)
+            return mat_convert_from(info->mi_type, src, data.size(),
+                                    data.data());
+
+        std::uint64_t chunk[512];
+        const size_t per_chunk = sizeof(chunk) / width;
+
+        for (size_t i = 0; i < data.size(); i += per_chunk)
+        {
+            const size_t count = std::min(per_chunk, data.size() - i);
+
+            std::memcpy(chunk, src + i * width, count * width);
+            mat_byte_swap(chunk, count * width, width);
+            mat_convert_from(info->mi_type, chunk, count, &data[i]);
+        }
+
+        return true;
+    }
+
+    /**
+     * Get the flag indicating if the file was successfully mapped and
+     * parsed
+     *
+     * @return True if object construction succeeded
+     */
+    bool is_ready() const
+    {
+        return _is_ready;
+    }
+
+    /**
+     * Get every variable in the file, in the order they appear
+     *
+     * @return The variables
+     */
+    const std::vector<var_info>& variables() const
+    {
+        return _variables;
+    }
+
+    /**
+     * List the variables in a file without reading their data. This
+     * hops from one element to the next, reading only the start of
+     * each. Compressed elements are listed too if MATFILE_USE_ZLIB is
+     * defined, in which case only their first few hundred bytes are
+     * inflated
+     *
+     * @param[in]  file      The MAT file to scan
+     * @param[out] variables The variables in the file, in the order
+     *                       they appear
+     *
+     * @return True if the file is a Level 5 MAT file
+     */
+    static bool scan(const std::string& file,
+                     std::vector<var_info>& variables)
+    {
+        const size_t HEADER_SIZE = 128;
+
+        variables.clear();
+
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat info;
+        std::uint16_t endian = 0;
+
+        const bool ok = ::fstat(fd, &info) == 0 &&
+            ::pread(fd, &endian, sizeof(endian), 126) == 2 &&
+            (endian == (('M') << 8 | 'I') ||
+             endian == (('I') << 8 | 'M'));
+
+        const bool swapped = endian == (('I') << 8 | 'M');
+
+        const size_t file_size = ok ? info.st_size : 0;
+
+        /*
+         * Enough to hold the header of any reasonably named variable,
+         * even when compressed:
+         */
+        std::vector<unsigned char> prefix(4096);
+
+        for (size_t offset = HEADER_SIZE; offset + 8 <= file_size; )
+        {
+            const ssize_t num =
+                ::pread(fd, prefix.data(),
+                        std::min(prefix.size(), file_size - offset),
+                        offset);
+            if (num < 8)
+                break;
+
+            var_info var;
+
+            if (describe(prefix.data(), num, offset,
+                         file_size - offset, swapped, var))
+                variables.push_back(var);
+
+            offset += var.size;
+        }
+
+        ::close(fd);
+        return ok;
+    }
+
+    /**
+     * Parse the tags at the start of a matrix element, up to and
+     * including the real part tag
+     *
+     * @param[in]  data   The matrix element, starting at its tag. Only
+     *                    its subelement headers need to be present
+     * @param[in]  size   The number of bytes available in data
+     * @param[in]  offset The position of data within the file (or the
+     *                    inflated stream)
+     * @param[out] info    The name, class, dimensions and data
+     *                     location of the variable. Variables which
+     *                     aren't numeric have no data
+     * @param[in]  swapped True if the data is in the opposite byte
+     *                     order to ours
+     *
+     * @return True if data holds a matrix
+     */
+    static bool parse_matrix(const unsigned char* data, size_t size,
+                             size_t offset, var_info& info,
+                             bool swapped = false)
+    {
+        std::uint32_t type, bytes;
+        const unsigned char* body;
+
+        if (size < 8 || load32(data, swapped) != miMATRIX)
+            return false;
+
+        info.swapped = swapped;
+
+        /*
+         * Step inside the matrix:
+         */
+        size_t pos = 8;
+
+        /*
+         * Array flags subelement. The class is in the low byte:
+         */
+        if (!read_tag(data, size, pos, type, bytes, body, swapped) ||
+            type != miUINT32 || bytes < 8)
+            return false;
+
+        info.mx_class = load32(body, swapped) & 0xFF;
+
+        /*
+         * Dimensions array subelement:
+         */
+        if (!read_tag(data, size, pos, type, bytes, body, swapped) ||
+            type != miINT32)
+            return false;
+
+        info.dims.clear();
+        info.numel = 1;
+
+        for (size_t i = 0; i + 4 <= bytes; i += 4)
+        {
+            const std::int32_t dim = load32(body + i, swapped);
+
+            info.dims.push_back(dim);
+            info.numel *= dim;
+        }
+
+        /*
+         * Array name subelement:
+         */
+        if (!read_tag(data, size, pos, type, bytes, body, swapped) ||
+            type != miINT8)
+            return false;
+
+        info.name.assign(reinterpret_cast<const char*>(body), bytes);
+
+        /*
+         * Only numeric arrays have a real part
+         */
+        if (info.mx_class < mxDOUBLE_CLASS ||
+            info.mx_class > mxUINT64_CLASS)
+        {
+            info.mi_type     = 0;
+            info.data_offset = 0;
+            info.data_bytes  = 0;
+            return true;
+        }
+
+        if (!read_tag(data, size, pos, type, bytes, body, swapped,
+                      false))
+            return false;
+
+        info.mi_type     = type;
+        info.data_offset = offset + (body - data);
+        info.data_bytes  = bytes;
+
+        return true;
+    }
+
+private:
+
+    /*
+     * Describe the element at the start of data, given the number of
+     * bytes available in data and the number left in the file from
+     * there on. Sets info.size to the distance to the next element
+     * even if the element isn't a variable
+     */
+    static bool describe(const unsigned char* data, size_t available,
+                         size_t offset, size_t remaining, bool swapped,
+                         var_info& info)
+    {
+        const std::uint32_t tag[] = { load32(data,     swapped),
+                                      load32(data + 4, swapped) };
+
+        info.name.clear();
+        info.mx_class    = 0;
+        info.mi_type     = 0;
+        info.dims.clear();
+        info.numel       = 0;
+        info.compressed  = tag[0] == miCOMPRESSED;
+        info.swapped     = swapped;
+        info.offset      = offset;
+        info.data_offset = 0;
+        info.data_bytes  = 0;
+
+        /*
+         * A file that is still being written may end part way through
+         * an element. Matrices are padded to 8 bytes, but compressed
+         * elements are not:
+         */
+        info.size = 8 + size_t(tag[1]);
+        if (tag[0] == miMATRIX)
+            info.size = (info.size + 7) & ~size_t(7);
+
+        info.size = std::min(info.size, remaining);
+
+        if (tag[0] == miMATRIX)
+        {
+            if (!parse_matrix(data, std::min(available, info.size),
+                              offset, info, swapped))
+                return false;
+
+            /*
+             * Only count the data that has been written so far:
+             */
+            info.data_bytes = std::min(info.data_bytes,
+                                       offset + remaining -
+                                       std::min(info.data_offset,
+                                                offset + remaining));
+            return true;
+        }
+        else if (info.compressed)
+        {
+#ifdef MATFILE_USE_ZLIB
+            unsigned char header[512];
+
+            z_stream zstream;
+            std::memset(&zstream, 0, sizeof(zstream));
+
+            if (::inflateInit(&zstream) != Z_OK)
+                return false;
+
+            zstream.next_in   = const_cast<unsigned char*>(data + 8);
+            zstream.avail_in  = std::min(available, info.size) - 8;
+            zstream.next_out  = header;
+            zstream.avail_out = sizeof(header);
+
+            ::inflate(&zstream, Z_SYNC_FLUSH);
+
+            const size_t num = sizeof(header) - zstream.avail_out;
+            ::inflateEnd(&zstream);
+
+            const size_t size = info.size;
+
+            if (!parse_matrix(header, num, 0, info, swapped))
+                return false;
+
+            info.offset = offset;
+            info.size   = size;
+#endif
+            return true;
+        }
+
+        return false;
+    }
+
+    /*
+     * Parse the data element starting at data[pos], leaving pos at the
+     * next (8-byte aligned) element. Elements with 4 bytes of data or
+     * less may be stored in the small data element format, in which
+     * the number of bytes is packed into the upper half of the type
+     *
+     * If need_body is false, only the tag itself has to be within
+     * the first size bytes of data
+     */
+    static bool read_tag(const unsigned char* data, size_t size,
+                         size_t& pos, std::uint32_t& type,
+                         std::uint32_t& bytes, const unsigned char*& body,
+                         bool swapped, bool need_body = true)
+    {
+        if (pos + 8 > size)
+            return false;
+
+        type = load32(data + pos, swapped);
+
+        if (type >> 16)
+        {
+            bytes = type >> 16;
+            type &= 0xFFFF;
+            body  = data + pos + 4;
+
+            pos += 8;
+            return bytes <= 4;
+        }
+
+        bytes = load32(data + pos + 4, swapped);
+        body  = data + pos + 8;
+
+        if (need_body && pos + 8 + bytes > size)
+            return false;
+
+        pos += 8 + ((bytes + 7) & ~size_t(7));
+        return true;
+    }
+
+    static std::uint32_t load32(const unsigned char* data, bool swapped)
+    {
+        std::uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+
+        if (swapped)
+            mat_byte_swap(&value, sizeof(value), sizeof(value));
+
+        return value;
+    }
+
+    /*
+     * Build the list of variables in the file
+     */
+    bool parse()
+    {
+        const size_t HEADER_SIZE = 128;
+
+        if (_size < HEADER_SIZE)
+            return false;
+
+        /*
+         * Make sure the file is a Level 5 MAT file, and find out which
+         * byte order it was written in:
+         */
+        std::uint16_t endian;
+        std::memcpy(&endian, _data + 126, sizeof(endian));
+
+        const bool swapped = endian == (('I') << 8 | 'M');
+
+        if (endian != (('M') << 8 | 'I') && !swapped)
+            return false;
+
+        for (size_t offset = HEADER_SIZE; offset + 8 <= _size; )
+        {
+            var_info info;
+
+            if (describe(_data + offset, _size - offset, offset,
+                         _size - offset, swapped, info))
+                _variables.push_back(info);
+
+            offset += info.size;
+        }
+
+        return true;
+    }
+
+    const unsigned char*  _data;
+    bool                  _is_ready;
+    size_t                _size;
+    std::vector<var_info> _variables;
+};
+
+/**
+ * Streams the samples of a single variable from a MAT file in fixed
+ * size blocks, so that memory use stays bounded no matter how large
+ * the file is. Data is read with pread(), and the kernel is told we
+ * will be reading sequentially so that it can read ahead
+ *
+ * Compressed (miCOMPRESSED) variables are inflated one block at a
+ * time. This requires building with MATFILE_USE_ZLIB defined, and
+ * linking against zlib. If a compressed variable was written with
+ * restart points (see MatFile::set_restart_interval()), read_all()
+ * inflates it on several threads at once
+ *
+ * Files written on a machine of the opposite byte order are swapped
+ * into ours a block at a time, as they are read
+ */
+class MatStream
+{
+public:
+
+    /**
+     * Constructor
+     *
+     * @param[in] file        The MAT file to read
+     * @param[in] name        The variable to stream
+     * @param[in] block_bytes The (maximum) size of each block
+     */
+    MatStream(const std::string& file, const std::string& name,
+              size_t block_bytes = 1 << 20)
+        : _block(std::max<size_t>(block_bytes, 8)),
+          _fd(-1),
+          _file(file),
+          _is_ready(false),
+          _pos(0)
+    {
+#ifdef MATFILE_USE_ZLIB
+        _inflating = false;
+#endif
+        _fd = ::open(file.c_str(), O_RDONLY);
+
+        _is_ready = _fd != -1 && locate(name);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (_is_ready)
+            ::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    /**
+     * Destructor
+     */
+    ~MatStream()
+    {
+#ifdef MATFILE_USE_ZLIB
+        if (_inflating)
+            ::inflateEnd(&_zstream);
+#endif
+        if (_fd != -1)
+            ::close(_fd);
+    }
+
+    MatStream(const MatStream& copy)            = delete;
+    MatStream& operator=(const MatStream& rhs) = delete;
+
+    /**
+     * Get information about the variable being streamed
+     *
+     * @return The variable's name, dimensions, etc.
+     */
+    const MatReader::var_info& info() const
+    {
+        return _info;
+    }
+
+    /**
+     * Get the flag indicating if the variable was found
+     *
+     * @return True if object construction succeeded
+     */
+    bool is_ready() const
+    {
+        return _is_ready;
+    }
+
+    /**
+     * Read the next block of samples. The returned view is valid until
+     * the next call
+     *
+     * @tparam T The type of the stored data. This must match the type
+     *           the data was written with exactly
+     *
+     * @return The next block, or an empty view once all samples have
+     *         been read (or on error)
+     */
+    template <typename T>
+    mat_span<const T> next()
+    {
+        if (!_is_ready || _info.mi_type != mi_type<T>())
+            return mat_span<const T>();
+
+        const size_t bytes =
+            read_into(_block.data(),
+                      (_block.size() / sizeof(T)) * sizeof(T));
+
+        return mat_span<const T>(
+            reinterpret_cast<const T*>(_block.data()),
+            bytes / sizeof(T));
+    }
+
+    /**
+     * Read all of the variable's samples at once, starting from the
+     * first. A compressed variable which has a restart table (<file>
+     * with its .mat extension replaced by .rst) is inflated on a pool
+     * of threads, each inflating the data between a pair of restart
+     * points
+     *
+     * @tparam T The type of the stored data. This must match the type
+     *           the data was written with exactly
+     *
+     * @param[out] data    The samples
+     * @param[in]  threads The number of threads to inflate with, or 0
+     *                     to use one per core
+     *
+     * @return True on success
+     */
+    template <typename T>
+    bool read_all(std::vector<T>& data, unsigned int threads = 0)
+    {
+        if (!_is_ready || _info.mi_type != mi_type<T>())
+            return false;
+
+        data.resize(_info.data_bytes / sizeof(T));
+
+        unsigned char* out =
+            reinterpret_cast<unsigned char*>(data.data());
+        const size_t bytes = data.size() * sizeof(T);
+
+#ifdef MATFILE_USE_ZLIB
+        std::vector<std::uint64_t> restarts;
+
+        /*
+         * Restart tables only come with files we wrote ourselves, which
+         * are never swapped:
+         */
+        if (_info.compressed && !_info.swapped &&
+            load_restarts(restarts))
+            return inflate_parallel(restarts, out, bytes, threads);
+#else
+        (void)threads;
+#endif
+        if (!rewind())
+            return false;
+
+        size_t done = 0;
+
+        while (done < bytes)
+        {
+            const size_t num = read_into(out + done, bytes - done);
+            if (num == 0)
+                break;
+
+            done += num;
+        }
+
+        return done == bytes;
+    }
+
+    /**
+     * Read a range of samples with a single pread(). Only available for
+     * uncompressed variables
+     *
+     * @tparam T The type of the stored data. This must match the type
+     *           the data was written with exactly
+     *
+     * @param[in]  first The first sample to read
+     * @param[in]  count The number of samples to read
+     * @param[out] data  The samples. This may be fewer than requested
+     *                   if the range runs past the end of the data
+     *
+     * @return True on success
+     */
+    template <typename T>
+    bool read_range(size_t first, size_t count, std::vector<T>& data)
+    {
+        if (!_is_ready || _info.compressed ||
+            _info.mi_type != mi_type<T>())
+            return false;
+
+        const size_t numel = _info.data_bytes / sizeof(T);
+
+        first = std::min(first, numel);
+        data.resize(std::min(count, numel - first));
+
+        const size_t bytes = data.size() * sizeof(T);
+
+        if (bytes > 0 &&
+            !read_at(data.data(), bytes,
+                     _info.data_offset + first * sizeof(T)))
+            return false;
+
+        if (_info.swapped)
+            mat_byte_swap(data.data(), bytes, sizeof(T));
+
+        return true;
+    }
+
+    /**
+     * Read all of the variable's samples converted to type U, whatever
+     * type they were stored as. Each block is converted as soon as it
+     * has been read (and inflated and swapped, if need be), so the
+     * samples are never all held in their stored type
+     *
+     * @tparam U The type to convert to
+     *
+     * @param[out] data The converted samples
+     *
+     * @return True on success
+     */
+    template <typename U>
+    bool read_as(std::vector<U>& data)
+    {
+        if (!_is_ready || _info.mi_type == 0)
+            return false;
+
+        /*
+         * Nothing to convert, and it may be possible to inflate in
+         * parallel:
+         */
+        if (_info.mi_type == mi_type<U>())
+            return read_all(data);
+
+        if (!rewind())
+            return false;
+
+        const size_t width = mi_type_size(_info.mi_type);
+        const size_t block = (_block.size() / width) * width;
+
+        data.resize(_info.data_bytes / width);
+
+        size_t done = 0;
+
+        while (done < data.size())
+        {
+            const size_t num =
+                read_into(_block.data(),
+                          std::min(block, (data.size() - done) * width))
+                / width;
+            if (num == 0)
+                break;
+
+            mat_convert_from(_info.mi_type, _block.data(), num,
+                             &data[done]);
+            done += num;
+        }
+
+        return done == data.size();
+    }
+
+    /**
+     * Go back to the first sample
+     *
+     * @return True on success
+     */
+    bool rewind()
+    {
+        _pos = 0;
+
+#ifdef MATFILE_USE_ZLIB
+        if (_info.compressed)
+            return _is_ready = start_inflating(_info.data_offset);
+#endif
+        return _is_ready;
+    }
+
+private:
+
+    /*
+     * Find the variable, using MatReader::scan()
+     */
+    bool locate(const std::string& name)
+    {
+        std::vector<MatReader::var_info> variables;
+        if (!MatReader::scan(_file, variables))
+            return false;
+
+        for (size_t i = 0; i < variables.size(); i++)
+        {
+            if (variables[i].name != name)
+                continue;
+
+            _info = variables[i];
+
+#ifdef MATFILE_USE_ZLIB
+            if (_info.compressed)
+            {
+                _in_begin = _info.offset + 8;
+                _in_end   = _info.offset + _info.size;
+
+                return start_inflating(_info.data_offset);
+            }
+#endif
+            return !_info.compressed && _info.mi_type != 0;
+        }
+
+        return false;
+    }
+
+    /*
+     * Read up to the next max_bytes bytes of data into out
+     */
+    size_t read_into(unsigned char* out, size_t max_bytes)
+    {
+        const size_t todo =
+            std::min(max_bytes, _info.data_bytes - _pos);
+
+        size_t done = 0;
+
+#ifdef MATFILE_USE_ZLIB
+        if (_info.compressed)
+            done = inflate_into(out, todo);
+        else
+#endif
+        while (done < todo)
+        {
+            const ssize_t num =
+                ::pread(_fd, out + done, todo - done,
+                        _info.data_offset + _pos + done);
+            if (num <= 0)
+                break;
+
+            done += num;
+        }
+
+        /*
+         * Callers ask for whole samples, so done only falls short of
+         * a whole number of them at the end of the data:
+         */
+        if (_info.swapped)
+            mat_byte_swap(out, done, mi_type_size(_info.mi_type));
+
+        _pos += done;
+        return done;
+    }
+
+    bool read_at(void* buf, size_t bytes, size_t offset) const
+    {
+        return ::pread(_fd, buf, bytes, offset) ==
+            static_cast<ssize_t>(bytes);
+    }
+
+#ifdef MATFILE_USE_ZLIB
+
+    /*
+     * (Re)start inflating the current compressed element, and skip
+     * the first skip bytes of the inflated stream
+     */
+    bool start_inflating(size_t skip)
+    {
+        if (_inflating)
+            ::inflateEnd(&_zstream);
+
+        std::memset(&_zstream, 0, sizeof(_zstream));
+
+        _inflating = ::inflateInit(&_zstream) == Z_OK;
+        _in_pos    = _in_begin;
+        _input.resize(64 * 1024);
+
+        while (_inflating && skip > 0)
+        {
+            const size_t num =
+                inflate_into(_block.data(),
+                             std::min(skip, _block.size()));
+            if (num == 0)
+                return false;
+
+            skip -= num;
+        }
+
+        return _inflating;
+    }
+
+    /*
+     * Inflate up to the next bytes bytes of the current element into
+     * out, reading compressed data as needed
+     */
+    size_t inflate_into(unsigned char* out, size_t bytes)
+    {
+        _zstream.next_out  = out;
+        _zstream.avail_out = bytes;
+
+        while (_zstream.avail_out > 0)
+        {
+            if (_zstream.avail_in == 0)
+            {
+                const size_t todo =
+                    std::min(_input.size(), _in_end - _in_pos);
+
+                if (todo == 0 || !read_at(_input.data(), todo, _in_pos))
+                    break;
+
+                _in_pos += todo;
+
+                _zstream.next_in  = _input.data();
+                _zstream.avail_in = todo;
+            }
+
+            if (::inflate(&_zstream, Z_NO_FLUSH) != Z_OK)
+                break;
+        }
+
+        return bytes - _zstream.avail_out;
+    }
+
+    /*
+     * Load the restart table written alongside a compressed variable,
+     * and make sure it describes this one
+     */
+    bool load_restarts(std::vector<std::uint64_t>& restarts) const
+    {
+        const size_t ext = _file.rfind(".mat");
+        if (ext == std::string::npos)
+            return false;
+
+        const std::string rst = _file.substr(0, ext) + ".rst";
+
+        const int fd = ::open(rst.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0)
+        {
+            restarts.resize(info.st_size / sizeof(std::uint64_t));
+
+            const size_t bytes =
+                restarts.size() * sizeof(std::uint64_t);
+
+            if (::pread(fd, restarts.data(), bytes, 0) !=
+                static_cast<ssize_t>(bytes))
+                restarts.clear();
+        }
+
+        ::close(fd);
+
+        if (restarts.size() < 4 || restarts.size() % 2 ||
+            restarts[0] != 0)
+            return false;
+
+        for (size_t i = 1; i < restarts.size(); i += 2)
+        {
+            if (restarts[i] < _info.offset ||
+                restarts[i] > _info.offset + _info.size)
+                return false;
+        }
+
+        return true;
+    }
+
+    /*
+     * Inflate the data between each pair of restart points into out,
+     * on up to the given number of threads
+     */
+    bool inflate_parallel(const std::vector<std::uint64_t>& restarts,
+                          unsigned char* out, size_t bytes,
+                          unsigned int threads) const
+    {
+        const size_t num_segments = restarts.size() / 2 - 1;
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        threads = std::min<size_t>(threads, num_segments);
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool>   ok(true);
+
+        auto work = [&] {
+            std::vector<unsigned char> input;
+
+            for (size_t i = next++; i < num_segments && ok; i = next++)
+            {
+                const size_t begin = restarts[2*i];
+                const size_t end   =
+                    std::min<size_t>(restarts[2*i + 2], bytes);
+
+                if (begin >= end)
+                    continue;
+
+                input.resize(restarts[2*i + 3] - restarts[2*i + 1]);
+
+                z_stream zstream;
+                std::memset(&zstream, 0, sizeof(zstream));
+
+                if (!read_at(input.data(), input.size(),
+                             restarts[2*i + 1]) ||
+                    ::inflateInit2(&zstream, -15) != Z_OK)
+                {
+                    ok = false;
+                    break;
+                }
+
+                zstream.next_in   = input.data();
+                zstream.avail_in  = input.size();
+                zstream.next_out  = out + begin;
+                zstream.avail_out = end - begin;
+
+                const int ret = ::inflate(&zstream, Z_SYNC_FLUSH);
+
+                if ((ret != Z_OK && ret != Z_STREAM_END) ||
+                    zstream.avail_out != 0)
+                    ok = false;
+
+                ::inflateEnd(&zstream);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned int i = 1; i < threads; i++)
+            pool.push_back(std::thread(work));
+
+        work();
+
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+
+        return ok;
+    }
+
+    size_t                     _in_begin;
+    size_t                     _in_end;
+    size_t                     _in_pos;
+    bool                       _inflating;
+    std::vector<unsigned char> _input;
+    z_stream                   _zstream;
+
+#endif
+
+    std::vector<unsigned char> _block;
+    int                        _fd;
+    const std::string          _file;
+    MatReader::var_info        _info;
+    bool                       _is_ready;
+    size_t                     _pos;
+};
+
+/**
+ * The seek index written alongside an indexed variable (see
+ * MatFile::Indexed), which maps sample numbers and wall-clock times
+ * to positions in the file. Lookups are binary searches
+ */
+class MatIndex
+{
+public:
+
+    /**
+     * One index entry
+     */
+    struct entry
+    {
+        std::uint64_t sample; /**< Sample number within the file */
+        std::uint64_t offset; /**< Offset of the sample in the file */
+        double        time;   /**< Wall-clock time of the sample, in
+                                   seconds since the epoch */
+    };
+
+    /**
+     * Constructor
+     *
+     * @param[in] file The MAT file whose index to load. The index is
+     *                 the same file with a .idx extension
+     */
+    MatIndex(const std::string& file)
+        : _entries(), _is_ready(false)
+    {
+        const size_t ext = file.rfind(".mat");
+        if (ext == std::string::npos)
+            return;
+
+        const std::string idx = file.substr(0, ext) + ".idx";
+
+        const int fd = ::open(idx.c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0)
+        {
+            _entries.resize(info.st_size / sizeof(entry));
+
+            const size_t bytes = _entries.size() * sizeof(entry);
+
+            _is_ready = ::pread(fd, _entries.data(), bytes, 0) ==
+                static_cast<ssize_t>(bytes);
+        }
+
+        ::close(fd);
+    }
+
+    /**
+     * Get every entry in the index
+     *
+     * @return The entries, in order of sample number
+     */
+    const std::vector<entry>& entries() const
+    {
+        return _entries;
+    }
+
+    /**
+     * Find the last entry at or before a sample
+     *
+     * @param[in] sample The sample number
+     *
+     * @return The entry, or NULL if there is none
+     */
+    const entry* find_sample(size_t sample) const
+    {
+        size_t lo = 0, hi = _entries.size();
+
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+
+            if (_entries[mid].sample <= sample)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return lo > 0 ? &_entries[lo - 1] : NULL;
+    }
+
+    /**
+     * Find the last entry written at or before a given time
+     *
+     * @param[in] time The wall-clock time, in seconds since the epoch
+     *
+     * @return The entry, or NULL if there is none
+     */
+    const entry* find_time(double time) const
+    {
+        size_t lo = 0, hi = _entries.size();
+
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+
+            if (_entries[mid].time <= time)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return lo > 0 ? &_entries[lo - 1] : NULL;
+    }
+
+    /**
+     * Find a range of samples which covers a range of time. The range
+     * is only as precise as the index stride, so it may include some
+     * samples on either side
+     *
+     * @param[in]  start The start of the time range
+     * @param[in]  end   The end of the time range
+     * @param[out] first The first sample of the range
+     * @param[out] count The number of samples in the range. If the
+     *                   range runs past the last entry, this is as
+     *                   large as possible
+     *
+     * @return True if the range overlaps the index
+     */
+    bool sample_range(double start, double end, size_t& first,
+                      size_t& count) const
+    {
+        if (_entries.empty() || end < start)
+            return false;
+
+        /*
+         * Samples from the last entry written before start on may be
+         * in the range. Several entries can have the same time, since
+         * the clock they are stamped with is coarse:
+         */
+        size_t lo = 0, hi = _entries.size();
+
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+
+            if (_entries[mid].time < start)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        first = lo > 0 ? _entries[lo - 1].sample : 0;
+
+        const entry* to = find_time(end);
+
+        if (to == NULL)
+            return false;
+        else if (to == &_entries.back())
+            count = static_cast<size_t>(-1) - first;
+        else
+            count = (to + 1)->sample - first;
+
+        return true;
+    }
+
+    /**
+     * Get the flag indicating if the index was loaded
+     *
+     * @return True if object construction succeeded
+     */
+    bool is_ready() const
+    {
+        return _is_ready;
+    }
+
+private:
+
+    std::vector<entry> _entries;
+    bool               _is_ready;
+};
+
+/**
+ * Follows a variable while a MatFile is still writing it, returning
+ * only samples which have been fully written. When the variable rolls
+ * over into a new part, MatTail moves on to it once the old part shows
+ * up in the variable's manifest
+ *
+ * MatFile writes the sample count twice, once in the dimensions and
+ * again as the size of the real part, and only after the samples
+ * themselves. If the two disagree, the header was caught part way
+ * through an update and is read again
+ *
+ * Only uncompressed Level 5 variables can be followed
+ */
+class MatTail
+{
+public:
+
+    /**
+     * Constructor
+     *
+     * @param[in] dir  The directory the MatFile is writing to
+     * @param[in] name The variable to follow
+     */
+    MatTail(const std::string& dir, const std::string& name)
+        : _count(0),
+          _dir(dir),
+          _fd(-1),
+          _name(name),
+          _part_count(0),
+          _part_index(1),
+          _watch_fd(-1)
+    {
+#ifdef __linux__
+        _watch_fd = ::inotify_init1(IN_NONBLOCK);
+#endif
+        open_part();
+    }
+
+    /**
+     * Destructor
+     */
+    ~MatTail()
+    {
+        if (_fd != -1)
+            ::close(_fd);
+        if (_watch_fd != -1)
+            ::close(_watch_fd);
+    }
+
+    MatTail(const MatTail& copy)            = delete;
+    MatTail& operator=(const MatTail& rhs) = delete;
+
+    /**
+     * Get the number of samples read so far
+     *
+     * @return The number of samples
+     */
+    size_t count() const
+    {
+        return _count;
+    }
+
+    /**
+     * Get the flag indicating if the variable's file has been found.
+     * If not, poll() keeps trying to find it
+     *
+     * @return True if the variable is being followed
+     */
+    bool is_ready() const
+    {
+        return _fd != -1;
+    }
+
+    /**
+     * Read any samples written since the last call
+     *
+     * @tparam T The type of the stored data. This must match the type
+     *           the data was written with exactly
+     *
+     * @param[out] data The new samples are appended to this
+     *
+     * @return The number of new samples
+     */
+    template <typename T>
+    size_t poll(std::vector<T>& data)
+    {
+        const size_t start = data.size();
+
+        while (is_ready() || open_part())
+        {
+            if (_info.mi_type != mi_type<T>())
+                break;
+
+            size_t committed;
+            if (!read_count(sizeof(T), committed))
+                break;
+
+            if (committed > _part_count)
+            {
+                const size_t old_size = data.size();
+                data.resize(old_size + committed - _part_count);
+
+                const size_t bytes =
+                    (committed - _part_count) * sizeof(T);
+
+                if (::pread(_fd, &data[old_size], bytes,
+                            _info.data_offset + _part_count * sizeof(T))
+                    != static_cast<ssize_t>(bytes))
+                {
+                    data.resize(old_size);
+                    break;
+                }
+
+                _count      += committed - _part_count;
+                _part_count  = committed;
+            }
+            else if (!part_finished())
+                break;
+            else
+            {
+                /*
+                 * Move on to the next part:
+                 */
+                ::close(_fd);
+                _fd = -1;
+
+                _part_count = 0;
+                _part_index++;
+            }
+        }
+
+        return data.size() - start;
+    }
+
+    /**
+     * Wait for the variable's file to change. On Linux this uses
+     * inotify; elsewhere it just sleeps
+     *
+     * @param[in] timeout_ms The maximum time to wait, in milliseconds
+     *
+     * @return True if the file changed, or may have changed
+     */
+    bool wait(int timeout_ms)
+    {
+#ifdef __linux__
+        if (_watch_fd != -1 && _fd != -1)
+        {
+            struct pollfd pfd = { _watch_fd, POLLIN, 0 };
+
+            if (::poll(&pfd, 1, timeout_ms) <= 0)
+                return false;
+
+            /*
+             * We only care that something happened:
+             */
+            char events[4096];
+            while (::read(_watch_fd, events, sizeof(events)) > 0);
+
+            return true;
+        }
+#endif
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(timeout_ms));
+
+        return true;
+    }
+
+private:
+
+    bool open_part()
+    {
+        const std::string file = part_file(_part_index);
+
+        _fd = ::open(file.c_str(), O_RDONLY);
+        if (_fd == -1)
+            return false;
+
+        /*
+         * The header is written in one go when the part is created,
+         * but we might get here before it is complete:
+         */
+        std::vector<unsigned char> prefix(128 + 8 + 64 + _name.size());
+
+        const ssize_t num =
+            ::pread(_fd, prefix.data(), prefix.size(), 0);
+
+        std::uint16_t endian = 0;
+        if (num >= 128)
+            std::memcpy(&endian, &prefix[126], sizeof(endian));
+
+        if (endian != (('M') << 8 | 'I') ||
+            !MatReader::parse_matrix(&prefix[128], num - 128, 128,
+                                     _info) ||
+            _info.name != _name)
+        {
+            ::close(_fd);
+            _fd = -1;
+
+            return false;
+        }
+
+#ifdef __linux__
+        if (_watch_fd != -1)
+            ::inotify_add_watch(_watch_fd, file.c_str(), IN_MODIFY);
+#endif
+        return true;
+    }
+
+    std::string part_file(int index) const
+    {
+        std::string file = _dir + "/" + _name;
+
+        if (index > 1)
+        {
+            char suffix[16];
+            std::snprintf(suffix, sizeof(suffix), "_part%03d", index);
+            file += suffix;
+        }
+
+        return file + ".mat";
+    }
+
+    /*
+     * Check whether the current part has been closed, and that we've
+     * read all of it
+     */
+    bool part_finished() const
+    {
+        std::ifstream manifest((_dir + "/" + _name +
+                                ".manifest").c_str());
+
+        const std::string file = basename(part_file(_part_index));
+
+        std::string part;
+        size_t first, count;
+
+        while (manifest >> part >> first >> count)
+        {
+            if (basename(part) == file)
+                return count == _part_count;
+        }
+
+        return false;
+    }
+
+    static std::string basename(const std::string& path)
+    {
+        const size_t slash = path.find_last_of("/\\");
+
+        return slash == std::string::npos ?
+            path : path.substr(slash + 1);
+    }
+
+    /*
+     * Read the number of samples in the current part
+     */
+    bool read_count(size_t size, size_t& count) const
+    {
+        const size_t dims_offset = 0xA0;
+
+        std::vector<unsigned char> header(
+            _info.data_offset - dims_offset);
+
+        for (int attempt = 0; attempt < 100; attempt++)
+        {
+            if (::pread(_fd, header.data(), header.size(), dims_offset)
+                != static_cast<ssize_t>(header.size()))
+                return false;
+
+            std::uint32_t rows, cols, bytes;
+            std::memcpy(&rows, &header[0], sizeof(rows));
+            std::memcpy(&cols, &header[4], sizeof(cols));
+            std::memcpy(&bytes, &header[header.size() - 4],
+                        sizeof(bytes));
+
+            const size_t numel = size_t(rows) * cols;
+
+            if (numel * size == bytes)
+            {
+                count = numel;
+                return true;
+            }
+
+            std::this_thread::yield();
+        }
+
+        return false;
+    }
+
+    size_t              _count;
+    const std::string   _dir;
+    int                 _fd;
+    MatReader::var_info _info;
+    const std::string   _name;
+    size_t              _part_count;
+    int                 _part_index;
+    int                 _watch_fd;
+};
+
+#endif // __MATREADER_H__